@@ -1,111 +1,708 @@
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
 #define MAX_MEMORY_ALLOCATED_SIZE 100000000 // 10^8
+#define MIN_SPLIT_SIZE 128 // smallest payload worth carving out of a reused block
+#define FREE_CLASSES 27 // class i holds free blocks of [2^i, 2^(i+1)) bytes, the last one everything larger
+#define SBRK_CHUNK_SIZE (1024 * 1024) // first heap growth with MALLOC_WILDERNESS, doubles on every refill
+#define SBRK_MAX_CHUNK (32 * 1024 * 1024)
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024) // with MALLOC_TRIM, a free heap top larger than this is returned
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (64 * 1024) // free bytes left at the top after trimming, so the break does not bounce
+#endif
 
+// Trimming always leaves some of the free top behind, so it never runs past the blocks it counted
+static_assert(TRIM_PAD < TRIM_THRESHOLD, "TRIM_PAD must be below TRIM_THRESHOLD");
+
+// 56 bytes on 64-bit, against the 32 of a plain address-list header. The free trees
+// take the 24 bytes of next_free, prev_free and largest_in_subtree from every block,
+// allocated or not: a payload can be a single byte, so they cannot live in the free
+// payload. In exchange both fit policies find a block in O(log n) instead of walking
+// every block of the heap.
 struct MallocMetadata {
     size_t block_size;
     bool is_available;
+    bool is_zeroed; // the payload is known to be zero, as handed out by sbrk
+    bool is_red;    // color in the free tree
     MallocMetadata* next_block;
     MallocMetadata* prev_block;
+    MallocMetadata* next_free; // right child in the free tree holding the block
+    MallocMetadata* prev_free; // left child
+    size_t largest_in_subtree; // largest block_size in the subtree rooted here
 };
 
 class MemoryManager {
     MallocMetadata* head;
+    MallocMetadata* tail; // the block list is kept in address order, so this is the top of the heap
+    // Free blocks live in left-leaning red-black trees made of their own headers
+    MallocMetadata* free_trees[FREE_CLASSES]; // per size class, keyed by address
+    unsigned int free_classes_mask;           // bit i is set while free_trees[i] is not empty
+    bool best_fit;                            // MALLOC_FIT=best keeps free blocks in free_tree instead
+    MallocMetadata* free_tree;                // keyed by (size, address)
+    size_t free_blocks_num;
+    size_t free_bytes_num;
+    size_t allocated_blocks_num;
+    size_t allocated_bytes_num;
+#ifdef MALLOC_WILDERNESS
+    char* wilderness;       // unused tail of the heap, later misses carve from it
+    size_t wilderness_size;
+    size_t sbrk_chunk;
+#endif
 
 public:
-    MemoryManager() : head(NULL) {}
+    MemoryManager() : head(NULL), tail(NULL), free_classes_mask(0), free_tree(NULL), free_blocks_num(0), free_bytes_num(0),
+                      allocated_blocks_num(0), allocated_bytes_num(0) {
+#ifdef MALLOC_WILDERNESS
+        wilderness = NULL;
+        wilderness_size = 0;
+        sbrk_chunk = SBRK_CHUNK_SIZE;
+#endif
+        const char* fit_policy = getenv("MALLOC_FIT");
+        best_fit = fit_policy != NULL && strcmp(fit_policy, "best") == 0;
+        for (int i = 0; i < FREE_CLASSES; i++) {
+            free_trees[i] = NULL;
+        }
+    }
+
+    // Merged blocks can grow past 10^8, so the last class is open ended
+    int get_size_class(size_t size) {
+        int size_class = 63 - __builtin_clzl(size);
+        return size_class < FREE_CLASSES ? size_class : FREE_CLASSES - 1;
+    }
+
+    // The first-fit trees are keyed by address, the best-fit one by (size, address)
+    bool precedes(MallocMetadata* first, MallocMetadata* second) {
+        if (best_fit && first->block_size != second->block_size) {
+            return first->block_size < second->block_size;
+        }
+        return first < second;
+    }
+
+    static bool is_red(MallocMetadata* node) { return node != NULL && node->is_red; }
+
+    static size_t largest_in(MallocMetadata* node) { return node != NULL ? node->largest_in_subtree : 0; }
+
+    static void update_largest(MallocMetadata* node) {
+        node->largest_in_subtree = node->block_size;
+        if (largest_in(node->prev_free) > node->largest_in_subtree) {
+            node->largest_in_subtree = largest_in(node->prev_free);
+        }
+        if (largest_in(node->next_free) > node->largest_in_subtree) {
+            node->largest_in_subtree = largest_in(node->next_free);
+        }
+    }
+
+    static MallocMetadata* rotate_left(MallocMetadata* node) {
+        MallocMetadata* right = node->next_free;
+        node->next_free = right->prev_free;
+        right->prev_free = node;
+        right->is_red = node->is_red;
+        node->is_red = true;
+        update_largest(node);
+        update_largest(right);
+        return right;
+    }
+
+    static MallocMetadata* rotate_right(MallocMetadata* node) {
+        MallocMetadata* left = node->prev_free;
+        node->prev_free = left->next_free;
+        left->next_free = node;
+        left->is_red = node->is_red;
+        node->is_red = true;
+        update_largest(node);
+        update_largest(left);
+        return left;
+    }
+
+    static void flip_colors(MallocMetadata* node) {
+        node->is_red = !node->is_red;
+        node->prev_free->is_red = !node->prev_free->is_red;
+        node->next_free->is_red = !node->next_free->is_red;
+    }
+
+    MallocMetadata* fix_up(MallocMetadata* node) {
+        if (is_red(node->next_free) && !is_red(node->prev_free)) {
+            node = rotate_left(node);
+        }
+        if (is_red(node->prev_free) && is_red(node->prev_free->prev_free)) {
+            node = rotate_right(node);
+        }
+        if (is_red(node->prev_free) && is_red(node->next_free)) {
+            flip_colors(node);
+        }
+        update_largest(node);
+        return node;
+    }
+
+    MallocMetadata* move_red_left(MallocMetadata* node) {
+        flip_colors(node);
+        if (is_red(node->next_free->prev_free)) {
+            node->next_free = rotate_right(node->next_free);
+            node = rotate_left(node);
+            flip_colors(node);
+        }
+        return node;
+    }
+
+    MallocMetadata* move_red_right(MallocMetadata* node) {
+        flip_colors(node);
+        if (is_red(node->prev_free->prev_free)) {
+            node = rotate_right(node);
+            flip_colors(node);
+        }
+        return node;
+    }
+
+    MallocMetadata* tree_insert(MallocMetadata* node, MallocMetadata* block) {
+        if (node == NULL) {
+            block->prev_free = NULL;
+            block->next_free = NULL;
+            block->is_red = true;
+            block->largest_in_subtree = block->block_size;
+            return block;
+        }
+        if (precedes(block, node)) {
+            node->prev_free = tree_insert(node->prev_free, block);
+        }
+        else {
+            node->next_free = tree_insert(node->next_free, block);
+        }
+        return fix_up(node);
+    }
+
+    MallocMetadata* tree_remove_min(MallocMetadata* node) {
+        if (node->prev_free == NULL) {
+            return NULL;
+        }
+        if (!is_red(node->prev_free) && !is_red(node->prev_free->prev_free)) {
+            node = move_red_left(node);
+        }
+        node->prev_free = tree_remove_min(node->prev_free);
+        return fix_up(node);
+    }
+
+    // The nodes are the blocks themselves, so a removed inner node is replaced by
+    // relinking its successor in its place rather than by copying keys
+    MallocMetadata* tree_remove(MallocMetadata* node, MallocMetadata* block) {
+        if (precedes(block, node)) {
+            if (!is_red(node->prev_free) && !is_red(node->prev_free->prev_free)) {
+                node = move_red_left(node);
+            }
+            node->prev_free = tree_remove(node->prev_free, block);
+            return fix_up(node);
+        }
+        if (is_red(node->prev_free)) {
+            node = rotate_right(node);
+        }
+        if (node == block && node->next_free == NULL) {
+            return NULL;
+        }
+        if (!is_red(node->next_free) && !is_red(node->next_free->prev_free)) {
+            node = move_red_right(node);
+        }
+        if (node == block) {
+            MallocMetadata* successor = node->next_free;
+            while (successor->prev_free != NULL) {
+                successor = successor->prev_free;
+            }
+            successor->next_free = tree_remove_min(node->next_free);
+            successor->prev_free = node->prev_free;
+            successor->is_red = node->is_red;
+            node = successor;
+        }
+        else {
+            node->next_free = tree_remove(node->next_free, block);
+        }
+        return fix_up(node);
+    }
+
+    // The lowest-address block of a first-fit tree that fits, found through the
+    // largest size kept for every subtree
+    static MallocMetadata* find_first_fit(MallocMetadata* node, size_t request_size) {
+        while (node != NULL && node->largest_in_subtree >= request_size) {
+            if (largest_in(node->prev_free) >= request_size) {
+                node = node->prev_free;
+            }
+            else if (node->block_size >= request_size) {
+                return node;
+            }
+            else {
+                node = node->next_free;
+            }
+        }
+        return NULL;
+    }
+
+    // The smallest block that fits, the lowest address among blocks of that size
+    MallocMetadata* find_best_fit(size_t request_size) {
+        MallocMetadata* fit = NULL;
+        MallocMetadata* curr = free_tree;
+        while (curr != NULL) {
+            if (curr->block_size >= request_size) {
+                fit = curr;
+                curr = curr->prev_free;
+            }
+            else {
+                curr = curr->next_free;
+            }
+        }
+        return fit;
+    }
+
+    void insert_to_free_list(MallocMetadata* block) {
+        if (best_fit) {
+            free_tree = tree_insert(free_tree, block);
+            free_tree->is_red = false;
+            return;
+        }
+        int size_class = get_size_class(block->block_size);
+        free_trees[size_class] = tree_insert(free_trees[size_class], block);
+        free_trees[size_class]->is_red = false;
+        free_classes_mask |= 1u << size_class;
+    }
+
+    void remove_from_free_list(MallocMetadata* block) {
+        MallocMetadata** root = &free_tree;
+        int size_class = get_size_class(block->block_size);
+        if (!best_fit) {
+            root = &free_trees[size_class];
+        }
+        *root = tree_remove(*root, block);
+        if (*root != NULL) {
+            (*root)->is_red = false;
+        }
+        else if (!best_fit) {
+            free_classes_mask &= ~(1u << size_class);
+        }
+        block->next_free = NULL;
+        block->prev_free = NULL;
+    }
+
+    // Carves the tail of an allocated block into a new free block when it can hold a
+    // header and MIN_SPLIT_SIZE bytes, the tail follows the block in the address list
+    void split_block(MallocMetadata* block, size_t request_size) {
+        if (block->block_size < request_size + sizeof(MallocMetadata) + MIN_SPLIT_SIZE) {
+            return;
+        }
+        MallocMetadata* remainder = (MallocMetadata*)((char*)block + sizeof(MallocMetadata) + request_size);
+        remainder->block_size = block->block_size - request_size - sizeof(MallocMetadata);
+        remainder->is_available = true;
+        remainder->is_zeroed = block->is_zeroed;
+        remainder->prev_block = block;
+        remainder->next_block = block->next_block;
+        if (block->next_block != NULL) {
+            block->next_block->prev_block = remainder;
+        }
+        else {
+            tail = remainder;
+        }
+        block->next_block = remainder;
+        block->block_size = request_size;
+        allocated_blocks_num++;
+        allocated_bytes_num -= sizeof(MallocMetadata);
+
+#ifdef MALLOC_COALESCE
+        remainder = coalesce(remainder);
+#endif
+        insert_to_free_list(remainder);
+        free_blocks_num++;
+        free_bytes_num += remainder->block_size;
+    }
+
+    // The lowest-address free block that fits, the same one a first-fit scan over all
+    // blocks finds. Each class from the request's own one up offers its own candidate.
+    MallocMetadata* find_free_block(size_t request_size) {
+        if (best_fit) {
+            return find_best_fit(request_size);
+        }
+        MallocMetadata* fit = NULL;
+        unsigned int classes = free_classes_mask & ~((1u << get_size_class(request_size)) - 1);
+        for (; classes != 0; classes &= classes - 1) {
+            MallocMetadata* candidate = find_first_fit(free_trees[__builtin_ctz(classes)], request_size);
+            if (candidate != NULL && (fit == NULL || candidate < fit)) {
+                fit = candidate;
+            }
+        }
+        return fit;
+    }
 
     MallocMetadata* get_block_start(void* memory) {
         return (MallocMetadata*)((char*)memory - sizeof(MallocMetadata));
     }
 
+#ifdef MALLOC_COALESCE
+    // The heap is contiguous unless someone else moved the break in between
+    bool is_adjacent(MallocMetadata* lower, MallocMetadata* upper) {
+        return (char*)lower + sizeof(MallocMetadata) + lower->block_size == (char*)upper;
+    }
+
+    void take_free_block(MallocMetadata* block) {
+        remove_from_free_list(block);
+        free_blocks_num--;
+        free_bytes_num -= block->block_size;
+    }
+
+    void absorb_next_block(MallocMetadata* block) {
+        MallocMetadata* next = block->next_block;
+        block->block_size += sizeof(MallocMetadata) + next->block_size;
+        block->next_block = next->next_block;
+        if (next->next_block != NULL) {
+            next->next_block->prev_block = block;
+        }
+        else {
+            tail = block;
+        }
+        allocated_blocks_num--;
+        allocated_bytes_num += sizeof(MallocMetadata);
+    }
+
+    // Merges a block that just became free with its free physical neighbours through the
+    // address list links. The result is not on a free list or in the free counters yet.
+    MallocMetadata* coalesce(MallocMetadata* block) {
+        MallocMetadata* next = block->next_block;
+        if (next != NULL && next->is_available && is_adjacent(block, next)) {
+            take_free_block(next);
+            absorb_next_block(block);
+            block->is_zeroed = false;
+        }
+        MallocMetadata* prev = block->prev_block;
+        if (prev != NULL && prev->is_available && is_adjacent(prev, block)) {
+            take_free_block(prev);
+            absorb_next_block(prev);
+            block = prev;
+            block->is_zeroed = false;
+        }
+        return block;
+    }
+#endif
+
     void mark_block_free(void* memory) {
         MallocMetadata* target_block = get_block_start(memory);
+        if (target_block->is_available) {
+            return;
+        }
         target_block->is_available = true;
+        target_block->is_zeroed = false;
+#ifdef MALLOC_COALESCE
+        target_block = coalesce(target_block);
+#endif
+        insert_to_free_list(target_block);
+        free_blocks_num++;
+        free_bytes_num += target_block->block_size;
+#ifdef MALLOC_TRIM
+        MallocMetadata* above = target_block->next_block;
+        while (above != NULL && above->is_available) {
+            above = above->next_block;
+        }
+        if (above == NULL) {
+            trim_top();
+        }
+#endif
     }
 
-    void insert_sorted(MallocMetadata* new_block) {
-        MallocMetadata* prev = NULL;
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            prev = curr;
-            curr = curr->next_block;
-        }
-        if (prev != NULL) {
-            prev->next_block = new_block;
-            new_block->prev_block = prev;
+    // New blocks always come from the top of the heap
+    void append_block(MallocMetadata* new_block) {
+        new_block->prev_block = tail;
+        new_block->next_block = NULL;
+        if (tail != NULL) {
+            tail->next_block = new_block;
         }
         else {
             head = new_block;
         }
+        tail = new_block;
     }
 
-    void* allocate_new_block(size_t request_size) {
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            if (curr->block_size >= request_size && curr->is_available) {
-                curr->is_available = false;
-                return curr;
+    // Where the next block of the heap starts
+    char* heap_top() {
+#ifdef MALLOC_WILDERNESS
+        return wilderness;
+#else
+        return (char*)sbrk(0);
+#endif
+    }
+
+#ifdef MALLOC_WILDERNESS
+    // The break was moved by someone else, so the wilderness can no longer grow.
+    // What is left of it becomes an ordinary free block.
+    void retire_wilderness() {
+        if (wilderness_size > sizeof(MallocMetadata)) {
+            MallocMetadata* block = new_block(carve_heap(wilderness_size), wilderness_size - sizeof(MallocMetadata));
+            mark_block_free((char*)block + sizeof(MallocMetadata));
+        }
+        wilderness_size = 0;
+    }
+#endif
+
+    // Makes sure the next size bytes can be carved off the top of the heap. Without
+    // MALLOC_WILDERNESS every carve is its own sbrk, so there is nothing to reserve.
+    bool reserve_heap(size_t size) {
+#ifdef MALLOC_WILDERNESS
+        if (wilderness_size >= size) {
+            return true;
+        }
+        bool contiguous = (char*)sbrk(0) == wilderness + wilderness_size;
+        if (!contiguous) {
+            retire_wilderness();
+        }
+        size_t missing = size - wilderness_size;
+        size_t chunk = sbrk_chunk;
+        if (chunk < missing) {
+            chunk = (missing + SBRK_CHUNK_SIZE - 1) / SBRK_CHUNK_SIZE * SBRK_CHUNK_SIZE;
+        }
+        void* memory = sbrk(chunk);
+        if (memory == (void*)-1) {
+            chunk = missing;
+            memory = sbrk(chunk);
+            if (memory == (void*)-1) {
+                return false;
             }
-            curr = curr->next_block;
         }
-        size_t total_size = request_size + sizeof(MallocMetadata);
-        void* new_memory = sbrk(total_size);
-        if (new_memory == (void*)-1) {
-            return NULL;
+        if (!contiguous) {
+            wilderness = (char*)memory;
         }
-        MallocMetadata* new_block = (MallocMetadata*)new_memory;
-        new_block->block_size = request_size;
-        new_block->is_available = false;
-        new_block->next_block = NULL;
-        new_block->prev_block = NULL;
-        insert_sorted(new_block);
-        return new_block;
+        wilderness_size += chunk;
+        // Frequent refills mean a fast growing heap, so ask for more next time
+        if (sbrk_chunk < SBRK_MAX_CHUNK) {
+            sbrk_chunk *= 2;
+        }
+        return true;
+#else
+        (void)size;
+        return true;
+#endif
     }
 
-    size_t total_allocated_memory() {
-        size_t total = 0;
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            total += curr->block_size;
-            curr = curr->next_block;
-        }
-        return total;
+    char* carve_heap(size_t size) {
+#ifdef MALLOC_WILDERNESS
+        char* memory = wilderness;
+        wilderness += size;
+        wilderness_size -= size;
+        return memory;
+#else
+        void* memory = sbrk(size);
+        return memory == (void*)-1 ? NULL : (char*)memory;
+#endif
     }
 
-    size_t total_blocks() {
-        size_t count = 0;
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            count++;
-            curr = curr->next_block;
+    MallocMetadata* new_block(char* memory, size_t request_size) {
+        MallocMetadata* block = (MallocMetadata*)memory;
+        block->block_size = request_size;
+        block->is_available = false;
+        block->is_zeroed = true;
+        block->next_free = NULL;
+        block->prev_free = NULL;
+        append_block(block);
+        allocated_blocks_num++;
+        allocated_bytes_num += request_size;
+        return block;
+    }
+
+    // Carves the missing bytes right after a block that sits at the top of the heap.
+    // Only the tail can grow, so other blocks do not reserve heap they cannot use. The
+    // reserve can still leave the block behind, when it retires a foreign-moved wilderness.
+    bool grow_at_top(MallocMetadata* block, size_t missing) {
+        return block->next_block == NULL && reserve_heap(missing) &&
+               (char*)block + sizeof(MallocMetadata) + block->block_size == heap_top() &&
+               carve_heap(missing) != NULL;
+    }
+
+    // A free block at the top of the heap that is too small grows in place instead of
+    // leaving it behind and adding a new block after it
+    MallocMetadata* extend_last_block(size_t request_size) {
+        MallocMetadata* last = tail;
+        size_t missing = last != NULL ? request_size - last->block_size : 0;
+        if (last == NULL || !last->is_available || !grow_at_top(last, missing)) {
+            return NULL;
         }
-        return count;
+        remove_from_free_list(last);
+        last->is_available = false;
+        free_blocks_num--;
+        free_bytes_num -= last->block_size;
+        allocated_bytes_num += missing;
+        last->block_size = request_size;
+        return last;
     }
 
-    size_t free_memory_total() {
-        size_t free_memory = 0;
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            if (curr->is_available) {
-                free_memory += curr->block_size;
+#ifdef MALLOC_TRIM
+    // Once the free memory between the last allocated block and the break exceeds
+    // TRIM_THRESHOLD, lowers the break so that only TRIM_PAD bytes of it are left
+    void trim_top() {
+        char* old_break = (char*)sbrk(0);
+        size_t free_top = 0;
+#ifdef MALLOC_WILDERNESS
+        if (wilderness + wilderness_size != old_break) {
+            return;
+        }
+        free_top = wilderness_size;
+#endif
+        char* end = heap_top();
+        MallocMetadata* block = tail;
+        for (; block != NULL && block->is_available; block = block->prev_block) {
+            if ((char*)block + sizeof(MallocMetadata) + block->block_size != end) {
+                break;
+            }
+            free_top += sizeof(MallocMetadata) + block->block_size;
+            end = (char*)block;
+        }
+        if (free_top <= TRIM_THRESHOLD) {
+            return;
+        }
+        size_t excess = free_top - TRIM_PAD;
+        size_t released = 0;
+#ifdef MALLOC_WILDERNESS
+        released = excess < wilderness_size ? excess : wilderness_size;
+        size_t wilderness_released = released;
+#endif
+        // Whole blocks go first, the lowest one released is cut short if it must stay
+        MallocMetadata* kept = tail;
+        size_t dropped_blocks = 0;
+        size_t dropped_bytes = 0;
+        size_t cut = 0;
+        while (released < excess) {
+            if (released + sizeof(MallocMetadata) + kept->block_size <= excess) {
+                released += sizeof(MallocMetadata) + kept->block_size;
+                dropped_blocks++;
+                dropped_bytes += kept->block_size;
+                kept = kept->prev_block;
+                continue;
+            }
+            cut = excess - released;
+            if (cut >= kept->block_size) {
+                cut = kept->block_size - 1;
             }
-            curr = curr->next_block;
+            released += cut;
+            break;
         }
-        return free_memory;
+        // The free trees run through the headers of the released blocks, so these leave
+        // the trees while still mapped and go back if the break cannot be moved
+        for (block = tail; block != kept; block = block->prev_block) {
+            remove_from_free_list(block);
+        }
+        if (cut != 0) {
+            remove_from_free_list(kept);
+        }
+        if (sbrk(-(intptr_t)released) == (void*)-1) {
+            for (block = tail; block != kept; block = block->prev_block) {
+                insert_to_free_list(block);
+            }
+            if (cut != 0) {
+                insert_to_free_list(kept);
+            }
+            return;
+        }
+#ifdef MALLOC_WILDERNESS
+        wilderness_size -= wilderness_released;
+        sbrk_chunk = SBRK_CHUNK_SIZE;
+#endif
+        tail = kept;
+        if (kept != NULL) {
+            kept->next_block = NULL;
+        }
+        else {
+            head = NULL;
+        }
+        free_blocks_num -= dropped_blocks;
+        free_bytes_num -= dropped_bytes;
+        allocated_blocks_num -= dropped_blocks;
+        allocated_bytes_num -= dropped_bytes;
+        if (cut != 0) {
+            kept->block_size -= cut;
+            insert_to_free_list(kept);
+            free_bytes_num -= cut;
+            allocated_bytes_num -= cut;
+        }
+        char* new_break = old_break - released;
+        // The page holding the new break stays mapped, memory grown back into it must
+        // still read as zero like the rest of fresh sbrk memory
+        size_t page_size = getpagesize();
+        char* page_end = (char*)(((size_t)new_break + page_size - 1) & ~(page_size - 1));
+        memset(new_break, 0, (page_end < old_break ? page_end : old_break) - new_break);
+#ifdef MALLOC_WILDERNESS
+        wilderness = new_break - wilderness_size;
+#endif
     }
+#endif
 
-    size_t free_blocks_count() {
-        size_t count = 0;
-        MallocMetadata* curr = head;
-        while (curr != NULL) {
-            if (curr->is_available) {
-                count++;
+    void* allocate_new_block(size_t request_size) {
+        MallocMetadata* fit = find_free_block(request_size);
+        if (fit != NULL) {
+            remove_from_free_list(fit);
+            fit->is_available = false;
+            free_blocks_num--;
+            free_bytes_num -= fit->block_size;
+            split_block(fit, request_size);
+            return fit;
+        }
+        // Every free block is too small by now, the last one included
+        MallocMetadata* extended = extend_last_block(request_size);
+        if (extended != NULL) {
+            return extended;
+        }
+        size_t total_size = request_size + sizeof(MallocMetadata);
+        if (!reserve_heap(total_size)) {
+            return NULL;
+        }
+        char* new_memory = carve_heap(total_size);
+        if (new_memory == NULL) {
+            return NULL;
+        }
+        return new_block(new_memory, request_size);
+    }
+
+#ifdef MALLOC_COALESCE
+    // Grows an allocated block into its free neighbours or past the top of the heap.
+    // Returns the new payload, or NULL when it has to be copied elsewhere.
+    void* resize_in_place(MallocMetadata* block, size_t new_size) {
+        block->is_zeroed = false;
+        MallocMetadata* next = block->next_block;
+        bool next_free = next != NULL && next->is_available && is_adjacent(block, next);
+        if (next_free && block->block_size + sizeof(MallocMetadata) + next->block_size >= new_size) {
+            take_free_block(next);
+            absorb_next_block(block);
+            split_block(block, new_size);
+            return (char*)block + sizeof(MallocMetadata);
+        }
+        MallocMetadata* prev = block->prev_block;
+        if (prev != NULL && prev->is_available && is_adjacent(prev, block)) {
+            size_t merged_size = prev->block_size + sizeof(MallocMetadata) + block->block_size;
+            if (next_free) {
+                merged_size += sizeof(MallocMetadata) + next->block_size;
+            }
+            if (merged_size >= new_size) {
+                size_t old_size = block->block_size;
+                take_free_block(prev);
+                absorb_next_block(prev);
+                if (next_free) {
+                    take_free_block(next);
+                    absorb_next_block(prev);
+                }
+                prev->is_available = false;
+                prev->is_zeroed = false;
+                memmove((char*)prev + sizeof(MallocMetadata), (char*)block + sizeof(MallocMetadata), old_size);
+                split_block(prev, new_size);
+                return (char*)prev + sizeof(MallocMetadata);
             }
-            curr = curr->next_block;
         }
-        return count;
+        size_t missing = new_size - block->block_size;
+        if (grow_at_top(block, missing)) {
+            block->block_size = new_size;
+            allocated_bytes_num += missing;
+            return (char*)block + sizeof(MallocMetadata);
+        }
+        return NULL;
     }
+#endif
+
+    size_t total_allocated_memory() { return allocated_bytes_num; }
+
+    size_t total_blocks() { return allocated_blocks_num; }
+
+    size_t free_memory_total() { return free_bytes_num; }
+
+    size_t free_blocks_count() { return free_blocks_num; }
 };
 
 MemoryManager memory_manager;
@@ -126,7 +723,10 @@ void* scalloc(size_t num, size_t size) {
     if (allocated_memory == NULL) {
         return NULL;
     }
-    memset(allocated_memory, 0, num * size);
+    // Fresh sbrk memory is already zeroed, only reused blocks need clearing
+    if (!memory_manager.get_block_start(allocated_memory)->is_zeroed) {
+        memset(allocated_memory, 0, num * size);
+    }
     return allocated_memory;
 }
 
@@ -148,6 +748,12 @@ void* srealloc(void* old_memory, size_t new_size) {
     if (current_size >= new_size) {
         return old_memory;
     }
+#ifdef MALLOC_COALESCE
+    void* resized_memory = memory_manager.resize_in_place(block_metadata, new_size);
+    if (resized_memory != NULL) {
+        return resized_memory;
+    }
+#endif
     void* new_memory = smalloc(new_size);
     if (new_memory == NULL) {
         return NULL;
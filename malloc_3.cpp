@@ -1,197 +1,1722 @@
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#if defined(MALLOC_PERCPU_CACHE) && !defined(__x86_64__)
+#undef MALLOC_PERCPU_CACHE // the rseq critical sections are x86-64 only, other targets keep the thread cache
+#endif
+#if defined(MALLOC_PERCPU_CACHE) && defined(MALLOC_THREAD_HEAPS)
+#error "MALLOC_PERCPU_CACHE and MALLOC_THREAD_HEAPS are alternative front ends"
+#endif
+#if (defined(MALLOC_PERCPU_CACHE) || defined(MALLOC_THREAD_HEAPS)) && !defined(MALLOC_MULTITHREADED)
+#define MALLOC_MULTITHREADED
+#endif
+#ifdef MALLOC_MULTITHREADED
+#include <pthread.h>
+#include <atomic>
+#endif
+#ifdef MALLOC_THREAD_HEAPS
+#include <stdint.h>
+#include <new>
+#endif
+#ifdef MALLOC_PERCPU_CACHE
+#include <sys/rseq.h>
+#include <sys/sysinfo.h>
+#include <stddef.h>
+#endif
 
 #define MAX_MEMORY_ALLOCATED_SIZE 100000000 // 10^8
 #define MIN_BLOCK_SIZE 128
 #define MAX_ORDER 10
 #define MMAP_THRESHOLD 131072
+#ifdef MALLOC_HUGE_PAGES
+#define SMALLOC_HUGE_PAGE_THRESHOLD (1000 * 1000 * 4)
+#define SCALLOC_HUGE_PAGE_THRESHOLD (1000 * 1000 * 2)
+#endif
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define INITIAL_BLOCKS_NUM 32
+#define TCACHE_MAX_ORDER 4 // blocks of up to 2 KiB are cached per thread
+#define TCACHE_DEPTH 32
+#define TCACHE_BATCH 8
+#define STATS_SHARDS 16
+#define MAX_CPUS 256
+#define ARENA_SIZE ((size_t)MMAP_THRESHOLD * INITIAL_BLOCKS_NUM)
+#define HEAP_HEADER_SIZE 16384
+#ifndef PURGE_DECAY_MS
+#define PURGE_DECAY_MS 10000 // free huge pages stay resident this long before they are purged
+#endif
+#define DECAY_STEPS 10
+// Decay periods shorter than DECAY_STEPS ms still sleep between steps instead of spinning
+#define DECAY_STEP_MS (PURGE_DECAY_MS >= DECAY_STEPS ? PURGE_DECAY_MS / DECAY_STEPS : 1)
+#define FREE_MAP_WORDS ((INITIAL_BLOCKS_NUM << MAX_ORDER) / 32 + MAX_ORDER + 1) // a bit per block position of every order
+#define SLAB_ORDER 5 // each slab is one 4 KiB buddy block
+#define SLAB_CLASS_STEP 16
+#define SLAB_MAX_SIZE 128
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_CLASS_STEP)
 
 struct MallocMetadata {
     size_t block_size;
     bool is_available;
+    bool is_zeroed; // the payload is known to be zero, as handed out by the OS
+    bool is_cached; // freed into a thread or CPU cache, or queued for its owner heap
+#ifdef MALLOC_HUGE_PAGES
+    bool is_huge_page : 1;     // mapped with MAP_HUGETLB
+    bool is_scalloc_block : 1; // mapped by scalloc, keeps the scalloc huge page threshold on srealloc
+#endif
+    // Bit i is set while page i of a free block is released to the OS. A top-order
+    // block spans at most 32 pages of 4 KiB, and the first page always holds the header.
+    unsigned int purged_pages;
     MallocMetadata* next_block;
     MallocMetadata* prev_block;
 };
 
+#ifdef MALLOC_MULTITHREADED
+// Split over cache-line sized shards so threads don't contend on one counter,
+// reading sums a fixed number of shards
+class StatCounter {
+    struct alignas(64) Shard {
+        std::atomic<size_t> value;
+    };
+    Shard shards[STATS_SHARDS];
+
+    static int current_shard() {
+        static std::atomic<int> next_shard(0);
+        static thread_local int shard = next_shard.fetch_add(1, std::memory_order_relaxed) % STATS_SHARDS;
+        return shard;
+    }
+
+public:
+    StatCounter() {
+        for (int i = 0; i < STATS_SHARDS; i++) {
+            shards[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void add(size_t delta) { shards[current_shard()].value.fetch_add(delta, std::memory_order_relaxed); }
+
+    void sub(size_t delta) { shards[current_shard()].value.fetch_sub(delta, std::memory_order_relaxed); }
+
+    size_t get() {
+        size_t sum = 0;
+        for (int i = 0; i < STATS_SHARDS; i++) {
+            sum += shards[i].value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+};
+
+class HeapLock {
+    pthread_mutex_t& mutex;
+    bool locked;
+
+public:
+    HeapLock(pthread_mutex_t& mutex, bool locked) : mutex(mutex), locked(locked) {
+        if (locked) {
+            pthread_mutex_lock(&mutex);
+        }
+    }
+    ~HeapLock() {
+        if (locked) {
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+};
+
+// Heaps owned by a single thread are only touched by that thread and need no lock
+#define LOCK_HEAP() HeapLock heap_lock(mutex, shared)
+#else
+class StatCounter {
+    size_t value;
+
+public:
+    StatCounter() : value(0) {}
+
+    void add(size_t delta) { value += delta; }
+
+    void sub(size_t delta) { value -= delta; }
+
+    size_t get() { return value; }
+};
+
+#define LOCK_HEAP()
+#endif
+
 class BuddyMemoryManager {
     MallocMetadata* free_lists[MAX_ORDER + 1];
-    MallocMetadata* allocated_list;
+    MallocMetadata* mmap_list;
+    char* heap_base;
+    unsigned int free_orders_mask; // bit i is set while free_lists[i] is not empty
+    // The free lists are unordered, a bit per possible block of every order picks the
+    // lowest-address free one. Each order owns the words [offsets[i], offsets[i + 1]).
+    unsigned long free_map[FREE_MAP_WORDS];
+    unsigned long free_map_summary[(FREE_MAP_WORDS + 63) / 64]; // bit per non-zero free_map word
+    size_t free_map_offsets[MAX_ORDER + 2];
+    // Shared by every heap so the statistics cover the whole process
+    static StatCounter free_blocks_num;
+    static StatCounter free_bytes_num;
+    static StatCounter allocated_blocks_num;
+    static StatCounter allocated_bytes_num;
+    static StatCounter purged_bytes_num;
+    size_t last_decay_ms;
+#ifdef MALLOC_MULTITHREADED
+    pthread_mutex_t mutex;
+    bool shared;
+#endif
 
 public:
-    BuddyMemoryManager() : allocated_list(NULL) {
+#ifdef MALLOC_MULTITHREADED
+    explicit BuddyMemoryManager(bool shared = true) : mmap_list(NULL), heap_base(NULL), free_orders_mask(0),
+                                                      last_decay_ms(0), shared(shared) {
+        pthread_mutex_init(&mutex, NULL);
+#else
+    BuddyMemoryManager() : mmap_list(NULL), heap_base(NULL), free_orders_mask(0), last_decay_ms(0) {
+#endif
+        size_t words = 0;
         for (int i = 0; i <= MAX_ORDER; i++) {
             free_lists[i] = NULL;
+            free_map_offsets[i] = words;
+            words += ((INITIAL_BLOCKS_NUM << (MAX_ORDER - i)) + 63) / 64;
         }
+        free_map_offsets[MAX_ORDER + 1] = words;
+        memset(free_map, 0, sizeof(free_map));
+        memset(free_map_summary, 0, sizeof(free_map_summary));
     }
 
-    MallocMetadata* get_allocated_list() { return allocated_list; }
+    void push_to_list(MallocMetadata*& list, MallocMetadata* block) {
+        block->next_block = list;
+        if (list != NULL) {
+            list->prev_block = block;
+        }
+        block->prev_block = NULL;
+        list = block;
+    }
 
-    void add_to_allocated_list(MallocMetadata* block) {
-        block->next_block = allocated_list;
-        if (allocated_list != NULL) {
-            allocated_list->prev_block = block;
+    void remove_from_list(MallocMetadata*& list, MallocMetadata* block) {
+        if (block->prev_block) {
+            block->prev_block->next_block = block->next_block;
         }
-        block->prev_block = NULL; 
-        allocated_list = block;
+        else {
+            list = block->next_block;
+        }
+        if (block->next_block) {
+            block->next_block->prev_block = block->prev_block;
+        }
+        block->next_block = NULL;
+        block->prev_block = NULL;
     }
 
-    size_t total_blocks() {
-        size_t count = 0;
-        for (int i = 0; i <= MAX_ORDER; i++) {
-            MallocMetadata* curr = free_lists[i];
-            while (curr != NULL) {
-                count++;
-                curr = curr->next_block;
+    size_t free_blocks_count() { return free_blocks_num.get(); }
+
+    size_t free_memory_total() { return free_bytes_num.get(); }
+
+    size_t total_blocks() { return allocated_blocks_num.get(); }
+
+    size_t total_allocated_memory() { return allocated_bytes_num.get(); }
+
+    size_t purged_memory_total() { return purged_bytes_num.get(); }
+
+    size_t order_size(int order) {
+        return (size_t)MIN_BLOCK_SIZE << order;
+    }
+
+    int get_order(size_t size) {
+        // ceil(log2(size)) relative to MIN_BLOCK_SIZE, sizes up to MIN_BLOCK_SIZE map to 0
+        size_t rounded = (size - 1) | (MIN_BLOCK_SIZE - 1);
+        int bits = (int)(sizeof(unsigned long) * 8) - __builtin_clzl(rounded);
+        return bits - __builtin_ctz(MIN_BLOCK_SIZE);
+    }
+
+    int find_free_order(int order) {
+        unsigned int candidates = free_orders_mask & (~0u << order);
+        if (candidates == 0) {
+            return -1;
+        }
+        return __builtin_ctz(candidates);
+    }
+
+    int get_block_order(MallocMetadata* block) {
+        return get_order(block->block_size + sizeof(MallocMetadata));
+    }
+
+    size_t free_map_bit(MallocMetadata* block, int order) {
+        return free_map_offsets[order] * 64 + arena_offset(block) / order_size(order);
+    }
+
+    void set_free_bit(size_t bit) {
+        free_map[bit / 64] |= 1ul << (bit % 64);
+        free_map_summary[bit / 4096] |= 1ul << (bit / 64 % 64);
+    }
+
+    void clear_free_bit(size_t bit) {
+        free_map[bit / 64] &= ~(1ul << (bit % 64));
+        if (free_map[bit / 64] == 0) {
+            free_map_summary[bit / 4096] &= ~(1ul << (bit / 64 % 64));
+        }
+    }
+
+    // Scans the summary words covering the order, at most a few words for any order
+    MallocMetadata* lowest_free_block(int order) {
+        size_t first_word = free_map_offsets[order];
+        size_t end_word = free_map_offsets[order + 1];
+        for (size_t summary_word = first_word / 64; summary_word * 64 < end_word; summary_word++) {
+            unsigned long words = free_map_summary[summary_word];
+            if (summary_word == first_word / 64) {
+                words &= ~0ul << (first_word % 64);
+            }
+            if ((summary_word + 1) * 64 > end_word) {
+                words &= (1ul << (end_word % 64)) - 1;
+            }
+            if (words != 0) {
+                size_t word = summary_word * 64 + __builtin_ctzl(words);
+                size_t index = (word - first_word) * 64 + __builtin_ctzl(free_map[word]);
+                return (MallocMetadata*)(heap_base + index * order_size(order));
             }
         }
-        MallocMetadata* curr_allocated = allocated_list;
-        while (curr_allocated != NULL) {
-            count++;
-            curr_allocated = curr_allocated->next_block;
+        return NULL;
+    }
+
+    void insert_to_free_list(MallocMetadata* block, int order) {
+        push_to_list(free_lists[order], block);
+        set_free_bit(free_map_bit(block, order));
+        free_orders_mask |= 1u << order;
+        free_blocks_num.add(1);
+        free_bytes_num.add(block->block_size);
+        purged_bytes_num.add(purged_size(block));
+    }
+
+    void remove_from_free_list(MallocMetadata* block, int order) {
+        clear_free_bit(free_map_bit(block, order));
+        if (block->prev_block) {
+            block->prev_block->next_block = block->next_block;
         }
-        return count;
+        else {
+            free_lists[order] = block->next_block;
+            if (free_lists[order] == NULL) {
+                free_orders_mask &= ~(1u << order);
+            }
+        }
+        if (block->next_block) {
+            block->next_block->prev_block = block->prev_block;
+        }
+        block->next_block = NULL;
+        block->prev_block = NULL;
+        free_blocks_num.sub(1);
+        free_bytes_num.sub(block->block_size);
+        purged_bytes_num.sub(purged_size(block));
+    }
+
+    // heap_base is published last, so once it is set the whole arena is ready
+    bool is_initialized() { return __atomic_load_n(&heap_base, __ATOMIC_ACQUIRE) != NULL; }
+
+    // Called without the lock by threads freeing blocks of other heaps, which may race
+    // with the first initialization
+    bool owns(MallocMetadata* block) {
+        char* base = __atomic_load_n(&heap_base, __ATOMIC_ACQUIRE);
+        return (char*)block >= base && (char*)block < base + order_size(MAX_ORDER) * INITIAL_BLOCKS_NUM;
+    }
+
+    bool has_free_block(int order) { return free_lists[order] != NULL; }
+
+    size_t arena_offset(void* memory) { return (char*)memory - heap_base; }
+
+    bool initialize() {
+        if (is_initialized()) {
+            return true;
+        }
+        LOCK_HEAP();
+        if (is_initialized()) {
+            return true;
+        }
+
+        // Align the break to a huge page, so the arena is made of whole huge pages
+        // the kernel can back transparently, and every top-order block is naturally aligned
+        size_t misalignment = (size_t)sbrk(0) % HUGE_PAGE_SIZE;
+        if (misalignment != 0 && sbrk(HUGE_PAGE_SIZE - misalignment) == (void*)-1) {
+            return false;
+        }
+        void* arena = sbrk(ARENA_SIZE);
+        if (arena == (void*)-1) {
+            return false;
+        }
+        madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+        seed_arena((char*)arena);
+#ifdef MALLOC_MULTITHREADED
+        pthread_t decay_thread;
+        if (pthread_create(&decay_thread, NULL, decay_loop, this) == 0) {
+            pthread_detach(decay_thread);
+        }
+#endif
+        return true;
+    }
+
+    void seed_arena(char* arena) {
+        size_t top_size = order_size(MAX_ORDER);
+        MallocMetadata* prev = NULL;
+        for (int i = 0; i < INITIAL_BLOCKS_NUM; i++) {
+            MallocMetadata* block = (MallocMetadata*)(arena + i * top_size);
+            block->block_size = top_size - sizeof(MallocMetadata);
+            block->is_available = true;
+            block->is_zeroed = true;
+            block->is_cached = false;
+            block->purged_pages = 0;
+            block->prev_block = prev;
+            block->next_block = NULL;
+            if (prev != NULL) {
+                prev->next_block = block;
+            }
+            else {
+                free_lists[MAX_ORDER] = block;
+            }
+            set_free_bit(free_map_offsets[MAX_ORDER] * 64 + i);
+            prev = block;
+        }
+        free_orders_mask |= 1u << MAX_ORDER;
+        free_blocks_num.add(INITIAL_BLOCKS_NUM);
+        free_bytes_num.add(INITIAL_BLOCKS_NUM * (top_size - sizeof(MallocMetadata)));
+        allocated_blocks_num.add(INITIAL_BLOCKS_NUM);
+        allocated_bytes_num.add(INITIAL_BLOCKS_NUM * (top_size - sizeof(MallocMetadata)));
+        __atomic_store_n(&heap_base, arena, __ATOMIC_RELEASE);
+    }
+
+    // Expects the heap lock to be held
+    MallocMetadata* split_free_block(int order) {
+        // Take the tightest free block, the arena is never grown
+        int source_order = find_free_order(order);
+        if (source_order < 0) {
+            return NULL;
+        }
+
+        if (source_order == MAX_ORDER) {
+            decay_dirty_pages(now_ms());
+        }
+        MallocMetadata* block = lowest_free_block(source_order);
+        remove_from_free_list(block, source_order);
+
+        // Split down, keeping the lower half and freeing the upper one. The upper half
+        // keeps its released pages, but for the one its header is written to.
+        while (source_order > order) {
+            source_order--;
+            MallocMetadata* upper_half = (MallocMetadata*)((char*)block + order_size(source_order));
+            size_t half_pages = order_size(source_order) / sysconf(_SC_PAGESIZE);
+            unsigned int purged_pages = block->purged_pages;
+            upper_half->block_size = order_size(source_order) - sizeof(MallocMetadata);
+            upper_half->is_available = true;
+            upper_half->is_zeroed = block->is_zeroed;
+            upper_half->is_cached = false;
+            upper_half->purged_pages = half_pages > 0 ? (purged_pages >> half_pages) & ~1u : 0;
+            block->purged_pages = half_pages > 0 ? purged_pages & ((1u << half_pages) - 1) : 0;
+            insert_to_free_list(upper_half, source_order);
+            allocated_blocks_num.add(1);
+            allocated_bytes_num.sub(sizeof(MallocMetadata));
+        }
+
+        block->block_size = order_size(order) - sizeof(MallocMetadata);
+        block->is_available = false;
+        block->is_cached = false;
+        block->purged_pages = 0;
+        block->next_block = NULL;
+        block->prev_block = NULL;
+        return block;
     }
 
     void* allocate_new_block(size_t request_size) {
-        size_t order = get_order(request_size);
+        int order = get_order(request_size + sizeof(MallocMetadata));
         if (order > MAX_ORDER) {
             return NULL;
         }
+        LOCK_HEAP();
+        return split_free_block(order);
+    }
+
+    MallocMetadata* get_buddy(MallocMetadata* block, int order) {
+        size_t offset = (char*)block - heap_base;
+        return (MallocMetadata*)(heap_base + (offset ^ order_size(order)));
+    }
+
+    MallocMetadata* merge_with_buddies(MallocMetadata* block, int max_order = MAX_ORDER) {
+        int order = get_block_order(block);
+        while (order < max_order) {
+            MallocMetadata* buddy = get_buddy(block, order);
+            if (!buddy->is_available || get_block_order(buddy) != order) {
+                break;
+            }
+            remove_from_free_list(buddy, order);
+            MallocMetadata* upper_half = buddy < block ? block : buddy;
+            if (buddy < block) {
+                block = buddy;
+            }
+            // The merged block keeps the pages either half released
+            size_t half_pages = order_size(order) / sysconf(_SC_PAGESIZE);
+            if (half_pages > 0) {
+                block->purged_pages |= upper_half->purged_pages << half_pages;
+            }
+            // The upper header becomes payload, wipe it so a clean block stays clean
+            block->is_zeroed = block->is_zeroed && upper_half->is_zeroed;
+            if (block->is_zeroed) {
+                memset(upper_half, 0, sizeof(MallocMetadata));
+            }
+            order++;
+            block->block_size = order_size(order) - sizeof(MallocMetadata);
+            allocated_blocks_num.sub(1);
+            allocated_bytes_num.add(sizeof(MallocMetadata));
+        }
+        return block;
+    }
 
-        size_t block_size = 1 << (order + 7);
-        void* new_memory = sbrk(block_size + sizeof(MallocMetadata));
-        if (new_memory == (void*)-1) {
+    bool can_merge_to_order(MallocMetadata* block, int target_order) {
+        if (target_order > MAX_ORDER) {
+            return false;
+        }
+        int order = get_block_order(block);
+        while (order < target_order) {
+            MallocMetadata* buddy = get_buddy(block, order);
+            if (!buddy->is_available || get_block_order(buddy) != order) {
+                return false;
+            }
+            if (buddy < block) {
+                block = buddy;
+            }
+            order++;
+        }
+        return true;
+    }
+
+    // Grows an allocated block by absorbing its free buddies, the data moves only
+    // when one of the absorbed buddies lies below the block
+    void* expand_in_place(void* memory, size_t request_size) {
+        MallocMetadata* block = (MallocMetadata*)((char*)memory - sizeof(MallocMetadata));
+        int target_order = get_order(request_size + sizeof(MallocMetadata));
+        LOCK_HEAP();
+        if (!can_merge_to_order(block, target_order)) {
             return NULL;
         }
 
-        MallocMetadata* new_block = (MallocMetadata*)new_memory;
-        new_block->block_size = block_size;
-        new_block->is_available = false;
-        new_block->next_block = NULL;
-        new_block->prev_block = NULL;
+        size_t old_size = block->block_size;
+        MallocMetadata* merged = merge_with_buddies(block, target_order);
+        merged->is_available = false;
+        merged->purged_pages = 0;
 
-        if (free_lists[order] == NULL) {
-            free_lists[order] = new_block;
+        void* new_memory = (char*)merged + sizeof(MallocMetadata);
+        if (merged != block) {
+            memmove(new_memory, memory, old_size);
         }
-        else {
-            MallocMetadata* current = free_lists[order];
-            while (current->next_block != NULL) {
-                current = current->next_block;
+        return new_memory;
+    }
+
+    // Expects the heap lock to be held
+    void release_block(MallocMetadata* block) {
+        block->is_available = true;
+        block->is_cached = false;
+        block = merge_with_buddies(block);
+        insert_to_free_list(block, get_block_order(block));
+        if (get_block_order(block) == MAX_ORDER && !block->is_zeroed) {
+            size_t now = now_ms();
+            *freed_at(block) = now;
+            decay_dirty_pages(now);
+        }
+    }
+
+    size_t purged_size(MallocMetadata* block) {
+        return __builtin_popcount(block->purged_pages) * sysconf(_SC_PAGESIZE);
+    }
+
+    // Gives the resident pages of a free block after the first one back to the OS and
+    // clears the rest of its first page, so the block is known to be zero afterwards.
+    // Pages a merged half released before are left alone. Expects the block to be
+    // in a free list.
+    size_t purge_block(MallocMetadata* block) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t pages_num = (block->block_size + sizeof(MallocMetadata)) / page_size;
+        // Clean blocks are either purged already or were never touched
+        if (block->is_zeroed || pages_num < 2) {
+            return 0;
+        }
+        unsigned int released_pages = 0;
+        size_t page = 1;
+        while (page < pages_num) {
+            if (block->purged_pages & (1u << page)) {
+                page++;
+                continue;
+            }
+            size_t run_end = page + 1;
+            while (run_end < pages_num && !(block->purged_pages & (1u << run_end))) {
+                run_end++;
+            }
+            if (madvise((char*)block + page * page_size, (run_end - page) * page_size, MADV_DONTNEED) != 0) {
+                break;
+            }
+            for (; page < run_end; page++) {
+                released_pages |= 1u << page;
             }
-            current->next_block = new_block;
-            new_block->prev_block = current;
         }
+        block->purged_pages |= released_pages;
+        purged_bytes_num.add(__builtin_popcount(released_pages) * page_size);
+        if (page == pages_num) {
+            memset((char*)block + sizeof(MallocMetadata), 0, page_size - sizeof(MallocMetadata));
+            block->is_zeroed = true;
+        }
+        return __builtin_popcount(released_pages) * page_size;
+    }
 
-        return new_block;
+    static size_t now_ms() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return now.tv_sec * 1000 + now.tv_nsec / 1000000;
     }
 
-    size_t get_order(size_t size) {
-        size_t order = 0;
-        size_t block_size = MIN_BLOCK_SIZE;
-        while (block_size < size && order < MAX_ORDER) {
-            block_size *= 2;
-            order++;
+    // A dirty free top-order block keeps the time it was freed at the start of its payload
+    size_t* freed_at(MallocMetadata* block) { return (size_t*)((char*)block + sizeof(MallocMetadata)); }
+
+    // Purges the huge pages whose top-order blocks have all been free for PURGE_DECAY_MS,
+    // so bursts reuse warm memory and live data keeps its huge page. Runs at most
+    // DECAY_STEPS times per decay period, with the lock held.
+    void decay_dirty_pages(size_t now) {
+        if (now - last_decay_ms < DECAY_STEP_MS) {
+            return;
         }
-        return order;
+        last_decay_ms = now;
+        size_t top_size = order_size(MAX_ORDER);
+        for (char* huge_page = heap_base; huge_page < heap_base + top_size * INITIAL_BLOCKS_NUM;
+             huge_page += HUGE_PAGE_SIZE) {
+            bool is_expired = true;
+            for (char* curr = huge_page; curr < huge_page + HUGE_PAGE_SIZE && is_expired; curr += top_size) {
+                MallocMetadata* top_block = (MallocMetadata*)curr;
+                is_expired = top_block->is_available && get_block_order(top_block) == MAX_ORDER &&
+                             (top_block->is_zeroed || now - *freed_at(top_block) >= PURGE_DECAY_MS);
+            }
+            for (char* curr = huge_page; curr < huge_page + HUGE_PAGE_SIZE && is_expired; curr += top_size) {
+                purge_block((MallocMetadata*)curr);
+            }
+        }
+    }
+
+#ifdef MALLOC_MULTITHREADED
+    // Keeps decaying while the process is idle and nothing reaches the slow paths
+    static void* decay_loop(void* manager) {
+        BuddyMemoryManager* heap = (BuddyMemoryManager*)manager;
+        while (true) {
+            usleep(DECAY_STEP_MS * 1000);
+            heap->decay();
+        }
+        return NULL;
+    }
+
+    void decay() {
+        LOCK_HEAP();
+        decay_dirty_pages(now_ms());
+    }
+#endif
+
+    // Purges every free block that covers whole pages, even inside a partly used huge page
+    size_t trim() {
+        size_t purged_size = 0;
+        LOCK_HEAP();
+        for (int order = 0; order <= MAX_ORDER; order++) {
+            for (MallocMetadata* curr = free_lists[order]; curr != NULL; curr = curr->next_block) {
+                purged_size += purge_block(curr);
+            }
+        }
+        return purged_size;
     }
 
     void mark_block_free(void* memory) {
         MallocMetadata* block = (MallocMetadata*)((char*)memory - sizeof(MallocMetadata));
-        block->is_available = true;
+        LOCK_HEAP();
+        release_block(block);
+    }
 
-        if (block->prev_block) {
-            block->prev_block->next_block = block->next_block;
+    // Blocks queued for their owner heap are still reported as free
+    void count_cached_block(MallocMetadata* block) {
+        free_blocks_num.add(1);
+        free_bytes_num.add(block->block_size);
+    }
+
+    void uncount_cached_block(MallocMetadata* block) {
+        free_blocks_num.sub(1);
+        free_bytes_num.sub(block->block_size);
+    }
+
+    // Hands up to count blocks of the given order to a block cache, chained through next_block
+    MallocMetadata* allocate_batch(int order, int count) {
+        MallocMetadata* batch = NULL;
+        LOCK_HEAP();
+        for (int i = 0; i < count; i++) {
+            MallocMetadata* block = split_free_block(order);
+            if (block == NULL) {
+                break;
+            }
+            block->next_block = batch;
+            batch = block;
+        }
+        return batch;
+    }
+
+    void free_batch(MallocMetadata* batch) {
+        LOCK_HEAP();
+        while (batch != NULL) {
+            MallocMetadata* next = batch->next_block;
+            release_block(batch);
+            batch = next;
+        }
+    }
+
+    bool is_mmap_block(MallocMetadata* block) {
+        return block->block_size + sizeof(MallocMetadata) > MMAP_THRESHOLD;
+    }
+
+    // Mappings of a huge page or more start on a huge page boundary so THP can back them
+    void* map_pages(size_t size) {
+        if (size < HUGE_PAGE_SIZE) {
+            void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            return memory == MAP_FAILED ? NULL : memory;
+        }
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t reserved_size = size + HUGE_PAGE_SIZE;
+        char* mapping = (char*)mmap(NULL, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+        char* memory = (char*)(((size_t)mapping + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+        char* memory_end = memory + (size + page_size - 1) / page_size * page_size;
+        if (memory > mapping) {
+            munmap(mapping, memory - mapping);
+        }
+        if (mapping + reserved_size > memory_end) {
+            munmap(memory_end, mapping + reserved_size - memory_end);
+        }
+        madvise(memory, size, MADV_HUGEPAGE);
+        return memory;
+    }
+
+    // The header ends the first page of the mapping, so the payload is page aligned
+    size_t mmap_header_offset() { return sysconf(_SC_PAGESIZE) - sizeof(MallocMetadata); }
+
+    size_t mapping_size(MallocMetadata* block) {
+        size_t size = mmap_header_offset() + sizeof(MallocMetadata) + block->block_size;
+#ifdef MALLOC_HUGE_PAGES
+        // Huge page mappings must be unmapped in whole huge pages
+        if (block->is_huge_page) {
+            size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        }
+#endif
+        return size;
+    }
+
+#ifdef MALLOC_HUGE_PAGES
+    void* map_huge_pages(size_t size) {
+        void* memory = mmap(NULL, (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE,
+                            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        return memory == MAP_FAILED ? NULL : memory;
+    }
+
+    void* allocate_mmap_block(size_t request_size, bool huge_page) {
+        size_t size = mmap_header_offset() + sizeof(MallocMetadata) + request_size;
+        char* new_memory = huge_page ? (char*)map_huge_pages(size) : NULL;
+        bool is_huge_page = new_memory != NULL;
+        // Fall back to normal pages when the huge page pool is exhausted
+        if (!is_huge_page) {
+            new_memory = (char*)map_pages(size);
+        }
+#else
+    void* allocate_mmap_block(size_t request_size) {
+        char* new_memory = (char*)map_pages(mmap_header_offset() + sizeof(MallocMetadata) + request_size);
+#endif
+        if (new_memory == NULL) {
+            return NULL;
+        }
+        MallocMetadata* block = (MallocMetadata*)(new_memory + mmap_header_offset());
+        block->block_size = request_size;
+        block->is_available = false;
+        block->is_zeroed = true;
+        block->is_cached = false;
+#ifdef MALLOC_HUGE_PAGES
+        block->is_huge_page = is_huge_page;
+        block->is_scalloc_block = false;
+#endif
+        LOCK_HEAP();
+        push_to_list(mmap_list, block);
+        allocated_blocks_num.add(1);
+        allocated_bytes_num.add(request_size);
+        return block;
+    }
+
+    void free_mmap_block(MallocMetadata* block) {
+        {
+            LOCK_HEAP();
+            remove_from_list(mmap_list, block);
+            allocated_blocks_num.sub(1);
+            allocated_bytes_num.sub(block->block_size);
+        }
+        munmap((char*)block - mmap_header_offset(), mapping_size(block));
+    }
+
+    // Moves page table entries instead of bytes, a shrink releases the tail pages in place
+    void* resize_mmap_block(MallocMetadata* block, size_t request_size) {
+        {
+            LOCK_HEAP();
+            remove_from_list(mmap_list, block);
+        }
+        size_t old_size = block->block_size;
+        size_t header_size = mmap_header_offset() + sizeof(MallocMetadata);
+        char* mapping = (char*)mremap((char*)block - mmap_header_offset(), header_size + old_size,
+                                      header_size + request_size, MREMAP_MAYMOVE);
+        MallocMetadata* new_block = mapping == MAP_FAILED ? block : (MallocMetadata*)(mapping + mmap_header_offset());
+        LOCK_HEAP();
+        push_to_list(mmap_list, new_block);
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+        new_block->block_size = request_size;
+        allocated_bytes_num.sub(old_size);
+        allocated_bytes_num.add(request_size);
+        return new_block;
+    }
+
+};
+
+StatCounter BuddyMemoryManager::free_blocks_num;
+StatCounter BuddyMemoryManager::free_bytes_num;
+StatCounter BuddyMemoryManager::allocated_blocks_num;
+StatCounter BuddyMemoryManager::allocated_bytes_num;
+StatCounter BuddyMemoryManager::purged_bytes_num;
+
+BuddyMemoryManager memory_manager;
+
+#ifdef MALLOC_THREAD_HEAPS
+// A buddy heap owned by one thread, in an ARENA_SIZE aligned mapping with this
+// header on the page just below it. Only the owner touches the free lists;
+// other threads hand blocks back through remote_frees, a lock-free stack that
+// the owner drains in one exchange on its next slow path.
+struct ThreadHeap {
+    BuddyMemoryManager manager;
+    std::atomic<MallocMetadata*> remote_frees;
+    ThreadHeap* next_orphan;
+
+    ThreadHeap() : manager(false), remote_frees(NULL), next_orphan(NULL) {}
+
+    static ThreadHeap* owner_of(MallocMetadata* block) {
+        uintptr_t arena = (uintptr_t)block & ~(uintptr_t)(ARENA_SIZE - 1);
+        return (ThreadHeap*)(arena - HEAP_HEADER_SIZE);
+    }
+
+    static ThreadHeap* create() {
+        // The header, the arena, and up to ARENA_SIZE of slack to align the arena
+        size_t reserved_size = HEAP_HEADER_SIZE + 2 * ARENA_SIZE;
+        char* mapping = (char*)mmap(NULL, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return NULL;
+        }
+        char* arena = (char*)(((uintptr_t)mapping + HEAP_HEADER_SIZE + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+        char* header = arena - HEAP_HEADER_SIZE;
+        if (arena + ARENA_SIZE > mapping + reserved_size) {
+            munmap(mapping, reserved_size);
+            return NULL;
+        }
+        if (header > mapping) {
+            munmap(mapping, header - mapping);
+        }
+        if (mapping + reserved_size > arena + ARENA_SIZE) {
+            munmap(arena + ARENA_SIZE, mapping + reserved_size - (arena + ARENA_SIZE));
+        }
+
+        madvise(arena, ARENA_SIZE, MADV_HUGEPAGE);
+        ThreadHeap* heap = new (header) ThreadHeap();
+        heap->manager.seed_arena(arena);
+        return heap;
+    }
+
+    // Queued blocks are reported as free, like blocks parked in a cache
+    void push_remote_free(MallocMetadata* block) {
+        manager.count_cached_block(block);
+        block->is_cached = true;
+        MallocMetadata* head = remote_frees.load(std::memory_order_relaxed);
+        do {
+            block->next_block = head;
+        } while (!remote_frees.compare_exchange_weak(head, block, std::memory_order_release,
+                                                     std::memory_order_relaxed));
+    }
+
+    void drain_remote_frees() {
+        MallocMetadata* batch = remote_frees.exchange(NULL, std::memory_order_acquire);
+        for (MallocMetadata* curr = batch; curr != NULL; curr = curr->next_block) {
+            manager.uncount_cached_block(curr);
+        }
+        manager.free_batch(batch);
+    }
+
+    void* allocate(size_t request_size) {
+        if (!manager.has_free_block(manager.get_order(request_size + sizeof(MallocMetadata)))) {
+            drain_remote_frees();
+        }
+        MallocMetadata* block = (MallocMetadata*)manager.allocate_new_block(request_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        return (char*)block + sizeof(MallocMetadata);
+    }
+};
+
+static_assert(sizeof(ThreadHeap) <= HEAP_HEADER_SIZE, "ThreadHeap must fit below its arena");
+
+// Heaps of exited threads may still own live blocks, so they are handed to the
+// next new thread instead of being unmapped
+pthread_mutex_t orphan_heaps_mutex = PTHREAD_MUTEX_INITIALIZER;
+ThreadHeap* orphan_heaps = NULL;
+
+// Outlives heap_owner, so frees from thread_local destructors that run after it
+// see that the heap was orphaned
+thread_local ThreadHeap* owned_heap = NULL;
+
+class HeapOwner {
+public:
+    ~HeapOwner() {
+        ThreadHeap* heap = owned_heap;
+        if (heap == NULL) {
+            return;
+        }
+        heap->drain_remote_frees();
+        pthread_mutex_lock(&orphan_heaps_mutex);
+        heap->next_orphan = orphan_heaps;
+        orphan_heaps = heap;
+        pthread_mutex_unlock(&orphan_heaps_mutex);
+        // Another thread may adopt the heap now, later frees of its blocks by this
+        // thread must queue them like any foreign free
+        owned_heap = NULL;
+    }
+
+    ThreadHeap* current() { return owned_heap; }
+
+    ThreadHeap* get() {
+        if (owned_heap != NULL) {
+            return owned_heap;
+        }
+        pthread_mutex_lock(&orphan_heaps_mutex);
+        ThreadHeap* heap = orphan_heaps;
+        if (heap != NULL) {
+            orphan_heaps = heap->next_orphan;
+        }
+        pthread_mutex_unlock(&orphan_heaps_mutex);
+        if (heap == NULL) {
+            heap = ThreadHeap::create();
+        }
+        owned_heap = heap;
+        return heap;
+    }
+};
+
+thread_local HeapOwner heap_owner;
+#endif
+
+// The heap the calling thread may modify the block through, NULL when another thread owns it
+BuddyMemoryManager* manager_of(MallocMetadata* block) {
+#ifdef MALLOC_THREAD_HEAPS
+    if (!memory_manager.owns(block)) {
+        ThreadHeap* heap = ThreadHeap::owner_of(block);
+        return heap == heap_owner.current() ? &heap->manager : NULL;
+    }
+#else
+    (void)block;
+#endif
+    return &memory_manager;
+}
+
+#ifdef MALLOC_MULTITHREADED
+// Per-thread bins of small free blocks, so the common smalloc/sfree pair never
+// takes the heap lock or touches shared counters. Bins refill from and drain to
+// the shared free lists in batches, and are flushed back when the thread exits.
+// Every cache is registered so the statistics can add up the bin depths, which
+// only the owner writes.
+class ThreadCache {
+    MallocMetadata* bins[TCACHE_MAX_ORDER + 1];
+    int counts[TCACHE_MAX_ORDER + 1];
+    ThreadCache* next;
+    ThreadCache* prev;
+
+    static pthread_mutex_t registry_mutex;
+    static ThreadCache* registry;
+    // Set once the cache is destroyed, so frees from later thread_local destructors take
+    // the locked path. Outside the object, so the store survives the end of its lifetime.
+    static thread_local bool is_destroyed;
+
+    void set_count(int order, int count) { __atomic_store_n(&counts[order], count, __ATOMIC_RELAXED); }
+
+public:
+    ThreadCache() : prev(NULL) {
+        for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+            bins[i] = NULL;
+            counts[i] = 0;
+        }
+        pthread_mutex_lock(&registry_mutex);
+        next = registry;
+        if (next != NULL) {
+            next->prev = this;
+        }
+        registry = this;
+        pthread_mutex_unlock(&registry_mutex);
+    }
+
+    ~ThreadCache() {
+        flush();
+        is_destroyed = true;
+        pthread_mutex_lock(&registry_mutex);
+        if (prev != NULL) {
+            prev->next = next;
         }
         else {
-            allocated_list = block->next_block; 
+            registry = next;
         }
-        if (block->next_block) {
-            block->next_block->prev_block = block->prev_block;
+        if (next != NULL) {
+            next->prev = prev;
+        }
+        pthread_mutex_unlock(&registry_mutex);
+    }
+
+    void* allocate(int order) {
+        if (is_destroyed) {
+            return NULL;
+        }
+        if (bins[order] == NULL) {
+            bins[order] = memory_manager.allocate_batch(order, TCACHE_BATCH);
+            int count = 0;
+            for (MallocMetadata* curr = bins[order]; curr != NULL; curr = curr->next_block) {
+                curr->is_cached = true;
+                count++;
+            }
+            if (bins[order] == NULL) {
+                return NULL;
+            }
+            set_count(order, count);
+        }
+        MallocMetadata* block = bins[order];
+        bins[order] = block->next_block;
+        set_count(order, counts[order] - 1);
+        block->is_cached = false;
+        block->next_block = NULL;
+        return (char*)block + sizeof(MallocMetadata);
+    }
+
+    bool deallocate(MallocMetadata* block) {
+        int order = memory_manager.get_block_order(block);
+        if (order > TCACHE_MAX_ORDER || is_destroyed) {
+            return false;
+        }
+        if (counts[order] >= TCACHE_DEPTH) {
+            MallocMetadata* batch = bins[order];
+            MallocMetadata* last = batch;
+            for (int i = 1; i < TCACHE_BATCH; i++) {
+                last = last->next_block;
+            }
+            bins[order] = last->next_block;
+            last->next_block = NULL;
+            set_count(order, counts[order] - TCACHE_BATCH);
+            memory_manager.free_batch(batch);
+        }
+        block->is_cached = true;
+        block->next_block = bins[order];
+        bins[order] = block;
+        set_count(order, counts[order] + 1);
+        return true;
+    }
+
+    void flush() {
+        for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+            memory_manager.free_batch(bins[i]);
+            bins[i] = NULL;
+            set_count(i, 0);
+        }
+    }
+
+    // Other threads may move the totals while they are summed, but never corrupt them
+    static size_t cached_blocks() {
+        size_t count = 0;
+        pthread_mutex_lock(&registry_mutex);
+        for (ThreadCache* cache = registry; cache != NULL; cache = cache->next) {
+            for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+                count += __atomic_load_n(&cache->counts[i], __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&registry_mutex);
+        return count;
+    }
+
+    static size_t cached_bytes() {
+        size_t bytes = 0;
+        pthread_mutex_lock(&registry_mutex);
+        for (ThreadCache* cache = registry; cache != NULL; cache = cache->next) {
+            for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+                size_t count = __atomic_load_n(&cache->counts[i], __ATOMIC_RELAXED);
+                bytes += count * (memory_manager.order_size(i) - sizeof(MallocMetadata));
+            }
+        }
+        pthread_mutex_unlock(&registry_mutex);
+        return bytes;
+    }
+};
+
+pthread_mutex_t ThreadCache::registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+ThreadCache* ThreadCache::registry = NULL;
+thread_local bool ThreadCache::is_destroyed = false;
+
+#endif
+
+#ifdef MALLOC_PERCPU_CACHE
+// A per-CPU list of cached blocks. head and depth are written together by one
+// 16-byte store, so the depth can be read from any CPU without touching the list.
+struct alignas(16) CpuBin {
+    MallocMetadata* head;
+    size_t depth;
+};
+
+// Restartable sequence primitives on a per-CPU bin. The commit is the single store
+// of the new head and depth, so a preemption or migration before it leaves the
+// bin untouched. Both fail if the thread is not running on cpu.
+
+// Returns 0 once the block is pushed, 1 when the bin is full and -1 on abort
+static inline int rseq_push(CpuBin* bin, MallocMetadata* block, int cpu) {
+    int result;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %%fs:8(%[rseq_offset])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t"
+        "jnz 4f\n\t"
+        "movq 8(%[bin]), %%rcx\n\t"
+        "cmpq %[max_depth], %%rcx\n\t"
+        "jae 6f\n\t"
+        "movq (%[bin]), %%rax\n\t"
+        "movq %%rax, %c[next_offset](%[block])\n\t"
+        "incq %%rcx\n\t"
+        "movq %[block], %%xmm0\n\t"
+        "movq %%rcx, %%xmm1\n\t"
+        "punpcklqdq %%xmm1, %%xmm0\n\t"
+        "movdqa %%xmm0, (%[bin])\n\t"
+        "2:\n\t"
+        "xorl %[result], %[result]\n\t"
+        "jmp 5f\n\t"
+        "6:\n\t"
+        "movl $1, %[result]\n\t"
+        "jmp 5f\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[signature]\n\t"
+        "4:\n\t"
+        "movl $-1, %[result]\n\t"
+        "jmp 5f\n\t"
+        ".popsection\n\t"
+        "5:\n\t"
+        : [result] "=&r"(result)
+        : [rseq_offset] "r"(__rseq_offset), [cpu] "r"(cpu), [bin] "r"(bin), [block] "r"(block),
+          [max_depth] "i"(TCACHE_DEPTH), [next_offset] "i"(offsetof(MallocMetadata, next_block)),
+          [signature] "i"(RSEQ_SIG)
+        : "rax", "rcx", "xmm0", "xmm1", "cc", "memory");
+    return result;
+}
+
+// Pops the head of the bin into *block, which is NULL when the bin is empty
+static inline bool rseq_pop(CpuBin* bin, MallocMetadata** block, int cpu) {
+    int failed;
+    MallocMetadata* popped;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %%fs:8(%[rseq_offset])\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t"
+        "jnz 4f\n\t"
+        "movq (%[bin]), %[popped]\n\t"
+        "testq %[popped], %[popped]\n\t"
+        "jz 2f\n\t"
+        "movq %c[next_offset](%[popped]), %%rax\n\t"
+        "movq 8(%[bin]), %%rcx\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rax, %%xmm0\n\t"
+        "movq %%rcx, %%xmm1\n\t"
+        "punpcklqdq %%xmm1, %%xmm0\n\t"
+        "movdqa %%xmm0, (%[bin])\n\t"
+        "2:\n\t"
+        "xorl %[failed], %[failed]\n\t"
+        "jmp 5f\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[signature]\n\t"
+        "4:\n\t"
+        "movl $1, %[failed]\n\t"
+        "jmp 5f\n\t"
+        ".popsection\n\t"
+        "5:\n\t"
+        : [failed] "=&r"(failed), [popped] "=&r"(popped)
+        : [rseq_offset] "r"(__rseq_offset), [cpu] "r"(cpu), [bin] "r"(bin),
+          [next_offset] "i"(offsetof(MallocMetadata, next_block)), [signature] "i"(RSEQ_SIG)
+        : "rax", "rcx", "xmm0", "xmm1", "cc", "memory");
+    *block = popped;
+    return failed == 0;
+}
+
+// Per-CPU bins of small free blocks in front of the shared free lists, so cached
+// memory scales with the number of cores rather than threads. Bins are only
+// changed inside rseq critical sections, so the fast path takes no lock and uses
+// no atomic instructions. Without a registered rseq area every call fails and
+// the caller falls back to the locked shared path.
+class CpuCache {
+    CpuBin bins[MAX_CPUS][TCACHE_MAX_ORDER + 1];
+    int cpus_num;
+
+    static int current_cpu() {
+        if (__rseq_size == 0) {
+            return -1;
+        }
+        struct rseq* area = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int)__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+        return cpu < MAX_CPUS ? cpu : -1;
+    }
+
+    bool push(MallocMetadata* block, int order) {
+        while (true) {
+            int cpu = current_cpu();
+            if (cpu < 0) {
+                return false;
+            }
+            int result = rseq_push(&bins[cpu][order], block, cpu);
+            if (result >= 0) {
+                return result == 0;
+            }
+        }
+    }
+
+    MallocMetadata* pop(int order) {
+        while (true) {
+            int cpu = current_cpu();
+            if (cpu < 0) {
+                return NULL;
+            }
+            MallocMetadata* block;
+            if (rseq_pop(&bins[cpu][order], &block, cpu)) {
+                return block;
+            }
+        }
+    }
+
+    void refill(int order) {
+        MallocMetadata* batch = memory_manager.allocate_batch(order, TCACHE_BATCH);
+        while (batch != NULL) {
+            MallocMetadata* next = batch->next_block;
+            batch->is_cached = true;
+            if (!push(batch, order)) {
+                batch->next_block = next;
+                memory_manager.free_batch(batch);
+                return;
+            }
+            batch = next;
         }
+    }
 
-        size_t order = get_order(block->block_size);
-        block->next_block = free_lists[order];
-        if (free_lists[order] != NULL) {
-            free_lists[order]->prev_block = block;
+    void drain(int order) {
+        MallocMetadata* batch = NULL;
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            MallocMetadata* block = pop(order);
+            if (block == NULL) {
+                break;
+            }
+            block->next_block = batch;
+            batch = block;
         }
-        free_lists[order] = block;
+        memory_manager.free_batch(batch);
+    }
+
+public:
+    // Hands every block cached for the current CPU back to the buddy engine
+    void flush() {
+        for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+            MallocMetadata* block;
+            while ((block = pop(i)) != NULL) {
+                block->next_block = NULL;
+                memory_manager.free_batch(block);
+            }
+        }
+    }
+
+    CpuCache() : cpus_num(get_nprocs_conf()) {
+        if (cpus_num > MAX_CPUS) {
+            cpus_num = MAX_CPUS;
+        }
+        for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+            for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+                bins[cpu][i].head = NULL;
+                bins[cpu][i].depth = 0;
+            }
+        }
+    }
+
+    void* allocate(int order) {
+        if (current_cpu() < 0) {
+            return NULL;
+        }
+        MallocMetadata* block = pop(order);
+        if (block == NULL) {
+            refill(order);
+            block = pop(order);
+            if (block == NULL) {
+                return NULL;
+            }
+        }
+        block->is_cached = false;
+        block->next_block = NULL;
         block->prev_block = NULL;
+        return (char*)block + sizeof(MallocMetadata);
+    }
+
+    bool deallocate(MallocMetadata* block) {
+        int order = memory_manager.get_block_order(block);
+        if (order > TCACHE_MAX_ORDER || current_cpu() < 0) {
+            return false;
+        }
+        block->is_cached = true;
+        if (push(block, order)) {
+            return true;
+        }
+        drain(order);
+        return push(block, order);
+    }
+
+    // Only the depths are read, so other threads may move the totals but never corrupt them
+    size_t cached_blocks() {
+        size_t count = 0;
+        for (int cpu = 0; cpu < cpus_num; cpu++) {
+            for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+                count += __atomic_load_n(&bins[cpu][i].depth, __ATOMIC_RELAXED);
+            }
+        }
+        return count;
+    }
+
+    size_t cached_bytes() {
+        size_t bytes = 0;
+        for (int cpu = 0; cpu < cpus_num; cpu++) {
+            for (int i = 0; i <= TCACHE_MAX_ORDER; i++) {
+                size_t depth = __atomic_load_n(&bins[cpu][i].depth, __ATOMIC_RELAXED);
+                bytes += depth * (memory_manager.order_size(i) - sizeof(MallocMetadata));
+            }
+        }
+        return bytes;
+    }
+};
+
+CpuCache block_cache;
+#elif defined(MALLOC_MULTITHREADED) && !defined(MALLOC_THREAD_HEAPS)
+thread_local ThreadCache block_cache;
+#endif
+
+#ifdef MALLOC_SLAB
+// Header of a slab, placed after the buddy metadata of the block it carves
+struct Slab {
+    Slab* next;
+    Slab* prev;
+    void* free_slots; // chained through the first word of each free slot
+    unsigned short used_slots;
+    unsigned short size_class;
+};
+
+// Serves requests of up to SLAB_MAX_SIZE bytes from equal slots of a buddy block,
+// without a header per object. Slabs only come from the shared heap, and a
+// byte per SLAB_ORDER sized chunk of its arena tells whether the chunk is a slab.
+class SlabAllocator {
+    Slab* partial_slabs[SLAB_CLASSES]; // slabs with at least one free slot
+    unsigned char slab_map[INITIAL_BLOCKS_NUM << (MAX_ORDER - SLAB_ORDER)];
+#ifdef MALLOC_MULTITHREADED
+    pthread_mutex_t mutex;
+    bool shared;
+#endif
+
+    size_t slab_index(void* memory) { return memory_manager.arena_offset(memory) / memory_manager.order_size(SLAB_ORDER); }
+
+    size_t slot_size(int size_class) { return (size_class + 1) * SLAB_CLASS_STEP; }
+
+    char* first_slot(Slab* slab) {
+        size_t header_size = sizeof(MallocMetadata) + sizeof(Slab);
+        return (char*)slab - sizeof(MallocMetadata) + (header_size + SLAB_CLASS_STEP - 1) / SLAB_CLASS_STEP * SLAB_CLASS_STEP;
+    }
+
+    // The arena is aligned to the top order, so slabs are aligned to their own size
+    Slab* slab_of(void* memory) {
+        size_t slab_start = (size_t)memory & ~(memory_manager.order_size(SLAB_ORDER) - 1);
+        return (Slab*)(slab_start + sizeof(MallocMetadata));
+    }
+
+    void link_slab(Slab* slab) {
+        slab->prev = NULL;
+        slab->next = partial_slabs[slab->size_class];
+        if (slab->next != NULL) {
+            slab->next->prev = slab;
+        }
+        partial_slabs[slab->size_class] = slab;
+    }
+
+    void unlink_slab(Slab* slab) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        }
+        else {
+            partial_slabs[slab->size_class] = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+    }
+
+    Slab* create_slab(int size_class) {
+        size_t slab_size = memory_manager.order_size(SLAB_ORDER);
+        MallocMetadata* block = (MallocMetadata*)memory_manager.allocate_new_block(slab_size - sizeof(MallocMetadata));
+        if (block == NULL) {
+            return NULL;
+        }
+        Slab* slab = (Slab*)((char*)block + sizeof(MallocMetadata));
+        slab->used_slots = 0;
+        slab->size_class = size_class;
+        slab->free_slots = NULL;
+
+        // Chain the slots from the last one down so they are handed out in address order
+        size_t slots_num = ((char*)block + slab_size - first_slot(slab)) / slot_size(size_class);
+        for (size_t i = slots_num; i > 0; i--) {
+            char* slot = first_slot(slab) + (i - 1) * slot_size(size_class);
+            *(void**)slot = slab->free_slots;
+            slab->free_slots = slot;
+        }
+        slab_map[slab_index(block)] = 1;
+        link_slab(slab);
+        return slab;
     }
 
-    MallocMetadata* get_free_list(int order) {
-        if (order < 0 || order > MAX_ORDER) return NULL;
-        return free_lists[order];
+public:
+#ifdef MALLOC_MULTITHREADED
+    SlabAllocator() : shared(true) {
+        pthread_mutex_init(&mutex, NULL);
+#else
+    SlabAllocator() {
+#endif
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            partial_slabs[i] = NULL;
+        }
+        memset(slab_map, 0, sizeof(slab_map));
     }
 
-    void set_free_list(int order, MallocMetadata* block) {
-        if (order < 0 || order > MAX_ORDER) return;
-        free_lists[order] = block;
+    bool is_slab_slot(void* memory) {
+        return memory_manager.owns((MallocMetadata*)memory) && slab_map[slab_index(memory)];
     }
 
-    void remove_from_allocated_list(MallocMetadata* block) {
-        if (!block || !allocated_list) return;
+    size_t usable_size(void* memory) { return slot_size(slab_of(memory)->size_class); }
+
+    int request_class(size_t size) { return (size - 1) / SLAB_CLASS_STEP; }
 
-        if (block == allocated_list) { 
-            allocated_list = block->next_block;
-            if (allocated_list) {
-                allocated_list->prev_block = NULL;
+    int slot_class(void* memory) { return slab_of(memory)->size_class; }
+
+    // Expects the slab lock to be held
+    void* take_slot(int size_class) {
+        Slab* slab = partial_slabs[size_class];
+        if (slab == NULL) {
+            slab = create_slab(size_class);
+            if (slab == NULL) {
+                return NULL;
             }
-            return;
         }
+        void* slot = slab->free_slots;
+        slab->free_slots = *(void**)slot;
+        slab->used_slots++;
+        if (slab->free_slots == NULL) {
+            unlink_slab(slab);
+        }
+        return slot;
+    }
 
-        if (block->prev_block) {
-            block->prev_block->next_block = block->next_block;
+    // Expects the slab lock to be held
+    void put_slot(void* memory) {
+        Slab* slab = slab_of(memory);
+        if (slab->free_slots == NULL) {
+            link_slab(slab);
         }
+        *(void**)memory = slab->free_slots;
+        slab->free_slots = memory;
+        slab->used_slots--;
 
-        if (block->next_block) {
-            block->next_block->prev_block = block->prev_block;
+        // Keep the last partial slab of a class so alternating smalloc/sfree doesn't thrash
+        if (slab->used_slots == 0 && (slab->prev != NULL || slab->next != NULL)) {
+            unlink_slab(slab);
+            slab_map[slab_index(slab)] = 0;
+            // The slots and the slab header were written, so the block is dirty like any freed block
+            ((MallocMetadata*)((char*)slab - sizeof(MallocMetadata)))->is_zeroed = false;
+            memory_manager.mark_block_free(slab);
+        }
+    }
+
+    void* allocate(size_t size) {
+        if (!memory_manager.initialize()) {
+            return NULL;
         }
+        LOCK_HEAP();
+        return take_slot(request_class(size));
+    }
+
+    void deallocate(void* memory) {
+        LOCK_HEAP();
+        put_slot(memory);
     }
 
+#ifdef MALLOC_MULTITHREADED
+    // Hands up to count slots of a class to a slot cache, chained through their first word
+    void* allocate_batch(int size_class, int count) {
+        if (!memory_manager.initialize()) {
+            return NULL;
+        }
+        void* batch = NULL;
+        LOCK_HEAP();
+        for (int i = 0; i < count; i++) {
+            void* slot = take_slot(size_class);
+            if (slot == NULL) {
+                break;
+            }
+            *(void**)slot = batch;
+            batch = slot;
+        }
+        return batch;
+    }
+
+    void free_batch(void* batch) {
+        LOCK_HEAP();
+        while (batch != NULL) {
+            void* next = *(void**)batch;
+            put_slot(batch);
+            batch = next;
+        }
+    }
+#endif
 };
 
-BuddyMemoryManager memory_manager;
+SlabAllocator slab_allocator;
+
+#ifdef MALLOC_MULTITHREADED
+// Per-thread stacks of free slots in front of the slabs, so a small smalloc/sfree
+// pair takes the slab lock once per batch rather than on every call
+class SlotCache {
+    void* bins[SLAB_CLASSES]; // chained through the first word of each slot
+    int counts[SLAB_CLASSES];
+
+    // Like ThreadCache::is_destroyed, sends slots freed by later thread_local destructors
+    // straight to their slabs
+    static thread_local bool is_destroyed;
+
+public:
+    SlotCache() {
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            bins[i] = NULL;
+            counts[i] = 0;
+        }
+    }
+
+    ~SlotCache() {
+        flush();
+        is_destroyed = true;
+    }
+
+    void* allocate(size_t size) {
+        if (is_destroyed) {
+            return slab_allocator.allocate(size);
+        }
+        int size_class = slab_allocator.request_class(size);
+        if (bins[size_class] == NULL) {
+            bins[size_class] = slab_allocator.allocate_batch(size_class, TCACHE_BATCH);
+            for (void* curr = bins[size_class]; curr != NULL; curr = *(void**)curr) {
+                counts[size_class]++;
+            }
+            if (bins[size_class] == NULL) {
+                return NULL;
+            }
+        }
+        void* slot = bins[size_class];
+        bins[size_class] = *(void**)slot;
+        counts[size_class]--;
+        return slot;
+    }
+
+    void deallocate(void* slot) {
+        if (is_destroyed) {
+            slab_allocator.deallocate(slot);
+            return;
+        }
+        int size_class = slab_allocator.slot_class(slot);
+        if (counts[size_class] >= TCACHE_DEPTH) {
+            void* batch = bins[size_class];
+            void* last = batch;
+            for (int i = 1; i < TCACHE_BATCH; i++) {
+                last = *(void**)last;
+            }
+            bins[size_class] = *(void**)last;
+            *(void**)last = NULL;
+            counts[size_class] -= TCACHE_BATCH;
+            slab_allocator.free_batch(batch);
+        }
+        *(void**)slot = bins[size_class];
+        bins[size_class] = slot;
+        counts[size_class]++;
+    }
+
+    void flush() {
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            slab_allocator.free_batch(bins[i]);
+            bins[i] = NULL;
+            counts[i] = 0;
+        }
+    }
+};
+
+thread_local bool SlotCache::is_destroyed = false;
+thread_local SlotCache slot_cache;
+#endif
+#endif
 
 void* smalloc(size_t size) {
+#ifdef MALLOC_SLAB
+    if (size != 0 && size <= SLAB_MAX_SIZE) {
+#ifdef MALLOC_MULTITHREADED
+        void* slot = slot_cache.allocate(size);
+#else
+        void* slot = slab_allocator.allocate(size);
+#endif
+        if (slot != NULL) {
+            return slot;
+        }
+    }
+#endif
+#ifdef MALLOC_THREAD_HEAPS
+    if (size != 0 && size + sizeof(MallocMetadata) <= MMAP_THRESHOLD) {
+        ThreadHeap* heap = heap_owner.get();
+        void* heap_memory = heap != NULL ? heap->allocate(size) : NULL;
+        if (heap_memory != NULL) {
+            return heap_memory;
+        }
+    }
+#elif defined(MALLOC_MULTITHREADED)
+    if (size != 0 && size + sizeof(MallocMetadata) <= memory_manager.order_size(TCACHE_MAX_ORDER)) {
+        void* cached_memory = block_cache.allocate(memory_manager.get_order(size + sizeof(MallocMetadata)));
+        if (cached_memory != NULL) {
+            return cached_memory;
+        }
+    }
+#endif
+    if (!memory_manager.initialize()) {
+        return NULL;
+    }
     if (size == 0 || size > MAX_MEMORY_ALLOCATED_SIZE) {
         return NULL;
     }
 
+    if (size + sizeof(MallocMetadata) > MMAP_THRESHOLD) {
+#ifdef MALLOC_HUGE_PAGES
+        MallocMetadata* block =
+            (MallocMetadata*)memory_manager.allocate_mmap_block(size, size >= SMALLOC_HUGE_PAGE_THRESHOLD);
+#else
+        MallocMetadata* block = (MallocMetadata*)memory_manager.allocate_mmap_block(size);
+#endif
+        if (block == NULL) {
+            return NULL;
+        }
+        return (char*)block + sizeof(MallocMetadata);
+    }
+
     MallocMetadata* block = (MallocMetadata*)memory_manager.allocate_new_block(size);
     if (block == NULL) {
         return NULL;
     }
 
-    memory_manager.add_to_allocated_list(block);
+    return (char*)block + sizeof(MallocMetadata);
+}
 
+#ifdef MALLOC_HUGE_PAGES
+// Maps a block with the lower scalloc huge page threshold. Fresh anonymous mappings
+// are already zeroed, so the huge pages are left untouched.
+void* allocate_scalloc_mmap_block(size_t size) {
+    if (!memory_manager.initialize()) {
+        return NULL;
+    }
+    MallocMetadata* block =
+        (MallocMetadata*)memory_manager.allocate_mmap_block(size, size >= SCALLOC_HUGE_PAGE_THRESHOLD);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->is_scalloc_block = true;
     return (char*)block + sizeof(MallocMetadata);
 }
+#endif
 
 void* scalloc(size_t num, size_t size) {
+#ifdef MALLOC_HUGE_PAGES
+    size_t total_size = num * size;
+    if (total_size != 0 && total_size <= MAX_MEMORY_ALLOCATED_SIZE && total_size + sizeof(MallocMetadata) > MMAP_THRESHOLD) {
+        return allocate_scalloc_mmap_block(total_size);
+    }
+#endif
     void* allocated_memory = smalloc(num * size);
     if (allocated_memory == NULL) {
         return NULL;
     }
-    memset(allocated_memory, 0, num * size);
+#ifdef MALLOC_SLAB
+    if (slab_allocator.is_slab_slot(allocated_memory)) {
+        memset(allocated_memory, 0, num * size);
+        return allocated_memory;
+    }
+#endif
+    // Memory that never left the allocator since the OS handed it out is already zeroed
+    MallocMetadata* block = (MallocMetadata*)((char*)allocated_memory - sizeof(MallocMetadata));
+    if (!block->is_zeroed) {
+        memset(allocated_memory, 0, num * size);
+    }
     return allocated_memory;
 }
 
 void sfree(void* memory) {
     if (memory == NULL) return;
+#ifdef MALLOC_SLAB
+    if (slab_allocator.is_slab_slot(memory)) {
+#ifdef MALLOC_MULTITHREADED
+        slot_cache.deallocate(memory);
+#else
+        slab_allocator.deallocate(memory);
+#endif
+        return;
+    }
+#endif
 
     MallocMetadata* block = (MallocMetadata*)((char*)memory - sizeof(MallocMetadata));
-    block->is_available = true;
-
-    memory_manager.remove_from_allocated_list(block);
+    // A block parked in a cache is still marked allocated to the buddy engine
+    if (block->is_available || block->is_cached) return;
 
-    if (block->next_block && block->next_block->is_available) {
-        block->block_size += sizeof(MallocMetadata) + block->next_block->block_size;
-        block->next_block = block->next_block->next_block;
+    if (memory_manager.is_mmap_block(block)) {
+        memory_manager.free_mmap_block(block);
+        return;
     }
-
-    size_t order = memory_manager.get_order(block->block_size);
-    block->next_block = memory_manager.get_free_list(order);
-    memory_manager.set_free_list(order, block);
+    block->is_zeroed = false;
+#if defined(MALLOC_MULTITHREADED) && !defined(MALLOC_THREAD_HEAPS)
+    if (block_cache.deallocate(block)) {
+        return;
+    }
+#endif
+    BuddyMemoryManager* manager = manager_of(block);
+#ifdef MALLOC_THREAD_HEAPS
+    if (manager == NULL) {
+        ThreadHeap::owner_of(block)->push_remote_free(block);
+        return;
+    }
+#endif
+    manager->mark_block_free(memory);
 }
 
 void* srealloc(void* old_memory, size_t new_size) {
@@ -201,12 +1726,57 @@ void* srealloc(void* old_memory, size_t new_size) {
     if (old_memory == NULL) {
         return smalloc(new_size);
     }
+#ifdef MALLOC_SLAB
+    if (slab_allocator.is_slab_slot(old_memory)) {
+        size_t slot_size = slab_allocator.usable_size(old_memory);
+        if (slot_size >= new_size) {
+            return old_memory;
+        }
+        void* new_memory = smalloc(new_size);
+        if (new_memory == NULL) {
+            return NULL;
+        }
+        memmove(new_memory, old_memory, slot_size);
+        sfree(old_memory);
+        return new_memory;
+    }
+#endif
     MallocMetadata* block_metadata = (MallocMetadata*)((char*)old_memory - sizeof(MallocMetadata));
     size_t current_size = block_metadata->block_size;
+    bool can_remap = memory_manager.is_mmap_block(block_metadata) && new_size + sizeof(MallocMetadata) > MMAP_THRESHOLD;
+#ifdef MALLOC_HUGE_PAGES
+    // Huge page blocks, and blocks that grow into the huge page range, are copied instead
+    can_remap = can_remap && !block_metadata->is_huge_page &&
+                new_size < (block_metadata->is_scalloc_block ? SCALLOC_HUGE_PAGE_THRESHOLD : SMALLOC_HUGE_PAGE_THRESHOLD);
+#endif
+    if (can_remap) {
+        MallocMetadata* resized_block = (MallocMetadata*)memory_manager.resize_mmap_block(block_metadata, new_size);
+        if (resized_block != NULL) {
+            return (char*)resized_block + sizeof(MallocMetadata);
+        }
+    }
     if (current_size >= new_size) {
         return old_memory;
     }
+    if (!memory_manager.is_mmap_block(block_metadata) && new_size + sizeof(MallocMetadata) <= MMAP_THRESHOLD) {
+        BuddyMemoryManager* manager = manager_of(block_metadata);
+        void* expanded_memory = manager != NULL ? manager->expand_in_place(old_memory, new_size) : NULL;
+        if (expanded_memory != NULL) {
+            return expanded_memory;
+        }
+    }
+#ifdef MALLOC_HUGE_PAGES
+    void* new_memory;
+    if (memory_manager.is_mmap_block(block_metadata) && block_metadata->is_scalloc_block &&
+        new_size + sizeof(MallocMetadata) > MMAP_THRESHOLD) {
+        new_memory = allocate_scalloc_mmap_block(new_size);
+    }
+    else {
+        new_memory = smalloc(new_size);
+    }
+#else
     void* new_memory = smalloc(new_size);
+#endif
     if (new_memory == NULL) {
         return NULL;
     }
@@ -216,36 +1786,54 @@ void* srealloc(void* old_memory, size_t new_size) {
 }
 
 size_t _num_free_blocks() {
-    return memory_manager.total_blocks();
+#if defined(MALLOC_PERCPU_CACHE)
+    return memory_manager.free_blocks_count() + block_cache.cached_blocks();
+#elif defined(MALLOC_MULTITHREADED) && !defined(MALLOC_THREAD_HEAPS)
+    return memory_manager.free_blocks_count() + ThreadCache::cached_blocks();
+#else
+    return memory_manager.free_blocks_count();
+#endif
 }
 
 size_t _num_free_bytes() {
-    return memory_manager.total_blocks() * MIN_BLOCK_SIZE;
+#if defined(MALLOC_PERCPU_CACHE)
+    return memory_manager.free_memory_total() + block_cache.cached_bytes();
+#elif defined(MALLOC_MULTITHREADED) && !defined(MALLOC_THREAD_HEAPS)
+    return memory_manager.free_memory_total() + ThreadCache::cached_bytes();
+#else
+    return memory_manager.free_memory_total();
+#endif
 }
 
-size_t _num_allocated_blocks() {
-    size_t count = 0;
-
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        MallocMetadata* curr = memory_manager.get_free_list(i);
-        while (curr != NULL) {
-            count++;
-            curr = curr->next_block;
-        }
-    }
-
-    MallocMetadata* curr_allocated = memory_manager.get_allocated_list();
-    while (curr_allocated != NULL) {
-        count++;
-        curr_allocated = curr_allocated->next_block;
+// Returns free pages to the OS. Caches of other threads and CPUs, and heaps
+// owned by other threads, are left alone.
+size_t strim() {
+#if defined(MALLOC_THREAD_HEAPS)
+    ThreadHeap* heap = heap_owner.current();
+    size_t purged_size = 0;
+    if (heap != NULL) {
+        heap->drain_remote_frees();
+        purged_size += heap->manager.trim();
     }
+    return purged_size + memory_manager.trim();
+#else
+#if defined(MALLOC_MULTITHREADED)
+    block_cache.flush();
+#endif
+    return memory_manager.trim();
+#endif
+}
 
-    return count;
+size_t _num_purged_bytes() {
+    return memory_manager.purged_memory_total();
 }
 
+size_t _num_allocated_blocks() {
+    return memory_manager.total_blocks();
+}
 
 size_t _num_allocated_bytes() {
-    return _num_free_bytes();
+    return memory_manager.total_allocated_memory();
 }
 
 size_t _size_meta_data() {
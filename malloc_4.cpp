@@ -0,0 +1,5 @@
+// The malloc_3 buddy engine, with large blocks backed by huge pages: smalloc at or
+// above SMALLOC_HUGE_PAGE_THRESHOLD and scalloc at or above SCALLOC_HUGE_PAGE_THRESHOLD
+// map MAP_HUGETLB pages, and fall back to normal pages when the pool is empty
+#define MALLOC_HUGE_PAGES
+#include "malloc_3.cpp"
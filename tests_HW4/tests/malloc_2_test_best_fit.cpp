@@ -0,0 +1,134 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+// Run with MALLOC_FIT=best in the environment, where a request takes the smallest free
+// block that fits, the lowest address among blocks of that size
+
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
+        REQUIRE(_num_allocated_bytes() == allocated_bytes);                                                            \
+        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
+        REQUIRE(_num_free_bytes() == free_bytes);                                                                      \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * allocated_blocks);                                       \
+    } while (0)
+
+#define verify_size(base)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        void *after = sbrk(0);                                                                                         \
+        REQUIRE(_num_allocated_bytes() + _size_meta_data() * _num_allocated_blocks() == (size_t)after - (size_t)base); \
+    } while (0)
+
+// The policy is picked once, when the allocator starts
+#define verify_policy()                                                                                                \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        const char *fit_policy = getenv("MALLOC_FIT");                                                                 \
+        REQUIRE(fit_policy != nullptr);                                                                                \
+        REQUIRE(strcmp(fit_policy, "best") == 0);                                                                      \
+    } while (0)
+
+TEST_CASE("the smallest fitting block is taken", "[malloc2bestfit]")
+{
+    verify_policy();
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(1000);
+    char *guard_a = (char *)smalloc(10);
+    char *b = (char *)smalloc(200);
+    char *guard_b = (char *)smalloc(10);
+    char *c = (char *)smalloc(500);
+    char *guard_c = (char *)smalloc(10);
+    REQUIRE(guard_c != nullptr);
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    verify_blocks(6, 1730, 3, 1700);
+
+    // First-fit would hand out a every time
+    char *small = (char *)smalloc(150);
+    REQUIRE(small == b);
+    char *medium = (char *)smalloc(400);
+    REQUIRE(medium == c);
+    verify_blocks(6, 1730, 1, 1000);
+
+    // Only a is left, and it is split
+    char *large = (char *)smalloc(100);
+    REQUIRE(large == a);
+    verify_blocks(7, 1730 - _size_meta_data(), 1, 1000 - 100 - _size_meta_data());
+    verify_size(base);
+
+    sfree(small);
+    sfree(medium);
+    sfree(large);
+    sfree(guard_a);
+    sfree(guard_b);
+    sfree(guard_c);
+    verify_blocks(7, 1730 - _size_meta_data(), 7, 1730 - _size_meta_data());
+}
+
+TEST_CASE("an exact fit beats a lower block", "[malloc2bestfit]")
+{
+    verify_policy();
+    verify_blocks(0, 0, 0, 0);
+    char *a = (char *)smalloc(300);
+    char *guard_a = (char *)smalloc(10);
+    char *b = (char *)smalloc(250);
+    char *guard_b = (char *)smalloc(10);
+    char *c = (char *)smalloc(200);
+    char *guard_c = (char *)smalloc(10);
+    REQUIRE(guard_c != nullptr);
+    sfree(a);
+    sfree(b);
+    sfree(c);
+
+    char *exact = (char *)smalloc(250);
+    REQUIRE(exact == b);
+    char *smaller = (char *)smalloc(190);
+    REQUIRE(smaller == c);
+    char *larger = (char *)smalloc(260);
+    REQUIRE(larger == a);
+    verify_blocks(6, 780, 0, 0);
+
+    sfree(exact);
+    sfree(smaller);
+    sfree(larger);
+    sfree(guard_a);
+    sfree(guard_b);
+    sfree(guard_c);
+}
+
+TEST_CASE("equal sizes go lowest address first", "[malloc2bestfit]")
+{
+    verify_policy();
+    verify_blocks(0, 0, 0, 0);
+    char *a = (char *)smalloc(200);
+    char *guard_a = (char *)smalloc(10);
+    char *b = (char *)smalloc(200);
+    char *guard_b = (char *)smalloc(10);
+    char *c = (char *)smalloc(200);
+    char *guard_c = (char *)smalloc(10);
+    REQUIRE(guard_c != nullptr);
+
+    // Freed from the top down, handed out from the bottom up
+    sfree(c);
+    sfree(b);
+    sfree(a);
+    REQUIRE(smalloc(200) == a);
+    REQUIRE(smalloc(200) == b);
+    REQUIRE(smalloc(200) == c);
+    verify_blocks(6, 630, 0, 0);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    sfree(guard_a);
+    sfree(guard_b);
+    sfree(guard_c);
+}
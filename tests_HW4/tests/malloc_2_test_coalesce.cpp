@@ -0,0 +1,153 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+#include <unistd.h>
+
+// Built with MALLOC_COALESCE, where freed blocks merge with their free neighbours and
+// srealloc grows blocks into them
+
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
+        REQUIRE(_num_allocated_bytes() == allocated_bytes);                                                            \
+        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
+        REQUIRE(_num_free_bytes() == free_bytes);                                                                      \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * allocated_blocks);                                       \
+    } while (0)
+
+#define verify_size(base)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        void *after = sbrk(0);                                                                                         \
+        REQUIRE(_num_allocated_bytes() + _size_meta_data() * _num_allocated_blocks() == (size_t)after - (size_t)base); \
+    } while (0)
+
+static void fill(char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        memory[i] = (char)i;
+    }
+}
+
+static bool holds(const char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (memory[i] != (char)i)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("free merges three adjacent blocks", "[malloc2coalesce]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(100);
+    char *c = (char *)smalloc(100);
+    char *guard = (char *)smalloc(100);
+    REQUIRE(guard != nullptr);
+    verify_blocks(4, 400, 0, 0);
+
+    // Neither neighbour of a or c is free yet
+    sfree(a);
+    sfree(c);
+    verify_blocks(4, 400, 2, 200);
+    verify_size(base);
+
+    // b joins both, and its headers become payload
+    sfree(b);
+    size_t merged_size = 300 + 2 * _size_meta_data();
+    verify_blocks(2, merged_size + 100, 1, merged_size);
+    verify_size(base);
+
+    char *reused = (char *)smalloc(merged_size);
+    REQUIRE(reused == a);
+    verify_blocks(2, merged_size + 100, 0, 0);
+    verify_size(base);
+
+    sfree(guard);
+    sfree(reused);
+    verify_blocks(1, merged_size + 100 + _size_meta_data(), 1, merged_size + 100 + _size_meta_data());
+    verify_size(base);
+}
+
+TEST_CASE("srealloc grows into a free next block", "[malloc2coalesce]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(1000);
+    char *guard = (char *)smalloc(100);
+    REQUIRE(guard != nullptr);
+    fill(a, 100);
+    sfree(b);
+    verify_blocks(3, 1200, 1, 1000);
+
+    // The block stays where it is, and what it does not need goes back as a free block
+    char *grown = (char *)srealloc(a, 600);
+    REQUIRE(grown == a);
+    REQUIRE(holds(grown, 100));
+    verify_blocks(3, 1200, 1, 500);
+    verify_size(base);
+
+    char *reused = (char *)smalloc(500);
+    REQUIRE(reused == a + 600 + _size_meta_data());
+    verify_blocks(3, 1200, 0, 0);
+
+    sfree(reused);
+    sfree(guard);
+    sfree(grown);
+    verify_blocks(1, 1200 + 2 * _size_meta_data(), 1, 1200 + 2 * _size_meta_data());
+    verify_size(base);
+}
+
+TEST_CASE("srealloc moves into a free previous block", "[malloc2coalesce]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(1000);
+    char *b = (char *)smalloc(100);
+    char *guard = (char *)smalloc(100);
+    REQUIRE(guard != nullptr);
+    fill(b, 100);
+    sfree(a);
+    verify_blocks(3, 1200, 1, 1000);
+
+    // Both blocks become one starting at a, so the data moves down
+    char *grown = (char *)srealloc(b, 1000 + _size_meta_data() + 100);
+    REQUIRE(grown == a);
+    REQUIRE(holds(grown, 100));
+    verify_blocks(2, 1200 + _size_meta_data(), 0, 0);
+    verify_size(base);
+
+    sfree(guard);
+    sfree(grown);
+    verify_blocks(1, 1200 + 2 * _size_meta_data(), 1, 1200 + 2 * _size_meta_data());
+    verify_size(base);
+}
+
+TEST_CASE("srealloc grows the last block past the break", "[malloc2coalesce]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    REQUIRE(a != nullptr);
+    fill(a, 100);
+
+    char *grown = (char *)srealloc(a, 5000);
+    REQUIRE(grown == a);
+    REQUIRE(holds(grown, 100));
+    verify_blocks(1, 5000, 0, 0);
+    verify_size(base);
+
+    sfree(grown);
+    verify_blocks(1, 5000, 1, 5000);
+    verify_size(base);
+}
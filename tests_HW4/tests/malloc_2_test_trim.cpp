@@ -0,0 +1,97 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+#include <unistd.h>
+
+// Built with MALLOC_TRIM, where a free heap top larger than TRIM_THRESHOLD is given back
+// to the OS, all but TRIM_PAD bytes of it
+
+#define TRIM_THRESHOLD (128 * 1024)
+#define TRIM_PAD (64 * 1024)
+
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
+        REQUIRE(_num_allocated_bytes() == allocated_bytes);                                                            \
+        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
+        REQUIRE(_num_free_bytes() == free_bytes);                                                                      \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * allocated_blocks);                                       \
+    } while (0)
+
+#define verify_size(base)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        void *after = sbrk(0);                                                                                         \
+        REQUIRE(_num_allocated_bytes() + _size_meta_data() * _num_allocated_blocks() == (size_t)after - (size_t)base); \
+    } while (0)
+
+static bool is_zero(const char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (memory[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("a large free top block is cut short", "[malloc2trim]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(200 * 1024);
+    REQUIRE(b != nullptr);
+    memset(b, 'b', 200 * 1024);
+
+    // The block stays, with only TRIM_PAD bytes of free top counting its header
+    sfree(b);
+    size_t kept_size = TRIM_PAD - _size_meta_data();
+    verify_blocks(2, 100 + kept_size, 1, kept_size);
+    verify_size(base);
+
+    // Growing back past the trimmed break reads as fresh memory
+    char *c = (char *)scalloc(1, 200 * 1024);
+    REQUIRE(c == b);
+    REQUIRE(is_zero(c, 200 * 1024));
+
+    sfree(a);
+    sfree(c);
+}
+
+TEST_CASE("whole free blocks at the top are released", "[malloc2trim]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(100 * 1024);
+    char *c = (char *)smalloc(100 * 1024);
+    REQUIRE(c != nullptr);
+
+    // Below the threshold, the break stays
+    sfree(c);
+    verify_blocks(3, 100 + 200 * 1024, 1, 100 * 1024);
+    verify_size(base);
+
+    // c goes back to the OS whole, b keeps what is left of the pad
+    sfree(b);
+    size_t kept_size = TRIM_PAD - _size_meta_data();
+    verify_blocks(2, 100 + kept_size, 1, kept_size);
+    verify_size(base);
+
+    // An allocated block above keeps the free blocks below it
+    char *d = (char *)smalloc(kept_size);
+    REQUIRE(d == b);
+    char *e = (char *)smalloc(TRIM_THRESHOLD);
+    REQUIRE(e == d + kept_size + _size_meta_data());
+    sfree(d);
+    verify_blocks(3, 100 + kept_size + TRIM_THRESHOLD, 1, kept_size);
+    verify_size(base);
+
+    sfree(a);
+    sfree(e);
+}
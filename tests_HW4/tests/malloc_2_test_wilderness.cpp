@@ -0,0 +1,114 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <unistd.h>
+
+// Built with MALLOC_WILDERNESS, where the heap grows by chunks that double on every
+// refill and blocks are carved from the unused tail of the last chunk
+
+#define SBRK_CHUNK_SIZE (1024 * 1024)
+
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
+        REQUIRE(_num_allocated_bytes() == allocated_bytes);                                                            \
+        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
+        REQUIRE(_num_free_bytes() == free_bytes);                                                                      \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * allocated_blocks);                                       \
+    } while (0)
+
+// The break is ahead of the last block by whatever is left of the wilderness
+#define verify_break(base, expected_size)                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        REQUIRE((size_t)sbrk(0) - (size_t)base == (size_t)(expected_size));                                            \
+    } while (0)
+
+TEST_CASE("chunks double on every refill", "[malloc2wilderness]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    REQUIRE((size_t)base + _size_meta_data() == (size_t)a);
+    verify_blocks(1, 10, 0, 0);
+    verify_break(base, SBRK_CHUNK_SIZE);
+
+    // Served from the first chunk without moving the break
+    char *b = (char *)smalloc(1000);
+    REQUIRE(b == a + 10 + _size_meta_data());
+    verify_blocks(2, 1010, 0, 0);
+    verify_break(base, SBRK_CHUNK_SIZE);
+
+    // Each refill extends the wilderness by twice the previous chunk
+    char *c = (char *)smalloc(SBRK_CHUNK_SIZE);
+    REQUIRE(c == b + 1000 + _size_meta_data());
+    verify_break(base, 3 * SBRK_CHUNK_SIZE);
+    char *d = (char *)smalloc(2 * SBRK_CHUNK_SIZE);
+    REQUIRE(d == c + SBRK_CHUNK_SIZE + _size_meta_data());
+    verify_break(base, 7 * SBRK_CHUNK_SIZE);
+    verify_blocks(4, 1010 + 3 * SBRK_CHUNK_SIZE, 0, 0);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    sfree(d);
+    verify_blocks(4, 1010 + 3 * SBRK_CHUNK_SIZE, 4, 1010 + 3 * SBRK_CHUNK_SIZE);
+}
+
+TEST_CASE("a foreign sbrk retires the wilderness", "[malloc2wilderness]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(10);
+    REQUIRE(a != nullptr);
+    verify_break(base, SBRK_CHUNK_SIZE);
+
+    // Someone else moves the break, the wilderness cannot grow into it anymore
+    char *foreign = (char *)sbrk(4096);
+    REQUIRE(foreign == (char *)base + SBRK_CHUNK_SIZE);
+
+    // Too big for what is left, so the rest of the first chunk becomes a free block and
+    // the block comes from a new chunk past the foreign memory
+    char *b = (char *)smalloc(SBRK_CHUNK_SIZE);
+    REQUIRE(b == foreign + 4096 + _size_meta_data());
+    size_t retired_size = SBRK_CHUNK_SIZE - 10 - 2 * _size_meta_data();
+    verify_blocks(3, 10 + retired_size + SBRK_CHUNK_SIZE, 1, retired_size);
+
+    // The retired block is an ordinary free block
+    char *c = (char *)smalloc(retired_size);
+    REQUIRE(c == a + 10 + _size_meta_data());
+    verify_blocks(3, 10 + retired_size + SBRK_CHUNK_SIZE, 0, 0);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    verify_blocks(3, 10 + retired_size + SBRK_CHUNK_SIZE, 3, 10 + retired_size + SBRK_CHUNK_SIZE);
+}
+
+TEST_CASE("a free last block grows in place", "[malloc2wilderness]")
+{
+    verify_blocks(0, 0, 0, 0);
+    void *base = sbrk(0);
+    char *a = (char *)smalloc(100);
+    char *b = (char *)smalloc(1000);
+    REQUIRE(b != nullptr);
+    sfree(b);
+    verify_blocks(2, 1100, 1, 1000);
+
+    // No free block fits, the free block at the top takes the missing bytes from the wilderness
+    char *c = (char *)smalloc(5000);
+    REQUIRE(c == b);
+    verify_blocks(2, 5100, 0, 0);
+    verify_break(base, SBRK_CHUNK_SIZE);
+
+    // An allocated last block is left alone, the request gets a block of its own
+    char *d = (char *)smalloc(5000);
+    REQUIRE(d == c + 5000 + _size_meta_data());
+    verify_blocks(3, 10100, 0, 0);
+
+    sfree(a);
+    sfree(c);
+    sfree(d);
+    verify_blocks(3, 10100, 3, 10100);
+}
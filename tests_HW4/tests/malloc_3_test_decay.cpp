@@ -0,0 +1,64 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+
+// Built with MALLOC_MULTITHREADED and PURGE_DECAY_MS of 0, so the background thread purges
+// free huge pages as soon as it wakes, and still has to sleep at least 1 ms per step
+
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define TOP_BLOCKS_PER_HUGE_PAGE (HUGE_PAGE_SIZE / MAX_ELEMENT_SIZE)
+#define WAIT_MS 200
+
+static double process_cpu_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+TEST_CASE("decay purges idle huge pages", "[malloc3decay]")
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t payload_size = MAX_ELEMENT_SIZE - _size_meta_data();
+    char *blocks[TOP_BLOCKS_PER_HUGE_PAGE];
+    for (int i = 0; i < TOP_BLOCKS_PER_HUGE_PAGE; i++)
+    {
+        blocks[i] = (char *)smalloc(payload_size);
+        REQUIRE(blocks[i] != nullptr);
+        memset(blocks[i], 'a', payload_size);
+    }
+
+    // A live block keeps its whole huge page resident
+    for (int i = 1; i < TOP_BLOCKS_PER_HUGE_PAGE; i++)
+    {
+        sfree(blocks[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+    REQUIRE(_num_purged_bytes() == 0);
+
+    // Once the huge page is all free, the decay thread releases it without further calls
+    sfree(blocks[0]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+    REQUIRE(_num_purged_bytes() == TOP_BLOCKS_PER_HUGE_PAGE * (MAX_ELEMENT_SIZE - page_size));
+
+    char *reused = (char *)smalloc(payload_size);
+    REQUIRE(reused == blocks[0]);
+    REQUIRE(_num_purged_bytes() == (TOP_BLOCKS_PER_HUGE_PAGE - 1) * (MAX_ELEMENT_SIZE - page_size));
+    sfree(reused);
+}
+
+TEST_CASE("decay thread sleeps between steps", "[malloc3decay]")
+{
+    sfree(smalloc(1));
+
+    // A thread waking without a pause spends over a tenth of the wait scanning the arena
+    double cpu_before = process_cpu_ms();
+    std::this_thread::sleep_for(std::chrono::milliseconds(WAIT_MS));
+    REQUIRE(process_cpu_ms() - cpu_before < WAIT_MS / 20);
+}
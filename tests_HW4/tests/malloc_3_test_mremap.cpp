@@ -0,0 +1,138 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstdio>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// srealloc resizes blocks above MMAP_THRESHOLD with mremap, moving page table entries
+// instead of copying the payload
+
+#define MMAP_THRESHOLD (128 * 1024)
+
+static void fill(char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        memory[i] = (char)(i * 7);
+    }
+}
+
+static bool holds(const char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (memory[i] != (char)(i * 7))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The address space the process has mapped so far
+static size_t mapped_size()
+{
+    size_t pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr)
+    {
+        if (fscanf(statm, "%zu", &pages) != 1)
+        {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+TEST_CASE("mremap grows a mapped block", "[malloc3mremap]")
+{
+    sfree(smalloc(MMAP_THRESHOLD));
+    size_t blocks_before = _num_allocated_blocks();
+    size_t bytes_before = _num_allocated_bytes();
+    size_t old_size = 2 * MMAP_THRESHOLD;
+    size_t new_size = 16 * MMAP_THRESHOLD;
+    char *a = (char *)smalloc(old_size);
+    REQUIRE(a != nullptr);
+    fill(a, old_size);
+    REQUIRE(_num_allocated_blocks() == blocks_before + 1);
+    REQUIRE(_num_allocated_bytes() == bytes_before + old_size);
+
+    char *b = (char *)srealloc(a, new_size);
+    REQUIRE(b != nullptr);
+    REQUIRE(holds(b, old_size));
+    REQUIRE(_num_allocated_blocks() == blocks_before + 1);
+    REQUIRE(_num_allocated_bytes() == bytes_before + new_size);
+
+    // The grown tail is fresh mapped memory
+    for (size_t i = old_size; i < new_size; i++)
+    {
+        REQUIRE(b[i] == 0);
+    }
+
+    sfree(b);
+    REQUIRE(_num_allocated_blocks() == blocks_before);
+    REQUIRE(_num_allocated_bytes() == bytes_before);
+}
+
+TEST_CASE("mremap shrinks a mapped block in place", "[malloc3mremap]")
+{
+    sfree(smalloc(MMAP_THRESHOLD));
+    size_t blocks_before = _num_allocated_blocks();
+    size_t bytes_before = _num_allocated_bytes();
+    size_t old_size = 16 * MMAP_THRESHOLD;
+    size_t new_size = 2 * MMAP_THRESHOLD;
+    char *a = (char *)smalloc(old_size);
+    REQUIRE(a != nullptr);
+    fill(a, old_size);
+    size_t mapped_before = mapped_size();
+
+    // The tail pages go back to the OS, the block keeps its address
+    char *b = (char *)srealloc(a, new_size);
+    REQUIRE(b == a);
+    REQUIRE(holds(b, new_size));
+    REQUIRE(_num_allocated_blocks() == blocks_before + 1);
+    REQUIRE(_num_allocated_bytes() == bytes_before + new_size);
+    REQUIRE(mapped_size() <= mapped_before - (old_size - new_size));
+
+    sfree(b);
+    REQUIRE(_num_allocated_blocks() == blocks_before);
+    REQUIRE(_num_allocated_bytes() == bytes_before);
+}
+
+TEST_CASE("a failed mremap leaves the block alone", "[malloc3mremap]")
+{
+    sfree(smalloc(MMAP_THRESHOLD));
+    size_t blocks_before = _num_allocated_blocks();
+    size_t bytes_before = _num_allocated_bytes();
+    size_t old_size = 2 * MMAP_THRESHOLD;
+    char *a = (char *)smalloc(old_size);
+    REQUIRE(a != nullptr);
+    fill(a, old_size);
+
+    // Cap the address space just above what is mapped, so neither mremap nor a fresh
+    // mapping to copy into can grow it
+    struct rlimit old_limit;
+    REQUIRE(getrlimit(RLIMIT_AS, &old_limit) == 0);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = mapped_size() + MMAP_THRESHOLD;
+    REQUIRE(setrlimit(RLIMIT_AS, &limit) == 0);
+    char *b = (char *)srealloc(a, 64 * MMAP_THRESHOLD);
+    REQUIRE(setrlimit(RLIMIT_AS, &old_limit) == 0);
+
+    REQUIRE(b == nullptr);
+    REQUIRE(holds(a, old_size));
+    REQUIRE(_num_allocated_blocks() == blocks_before + 1);
+    REQUIRE(_num_allocated_bytes() == bytes_before + old_size);
+
+    // The block is still tracked, so it can grow once memory is available again
+    b = (char *)srealloc(a, 4 * MMAP_THRESHOLD);
+    REQUIRE(b != nullptr);
+    REQUIRE(holds(b, old_size));
+    REQUIRE(_num_allocated_bytes() == bytes_before + 4 * MMAP_THRESHOLD);
+
+    sfree(b);
+    REQUIRE(_num_allocated_blocks() == blocks_before);
+    REQUIRE(_num_allocated_bytes() == bytes_before);
+}
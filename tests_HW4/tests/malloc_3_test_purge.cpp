@@ -0,0 +1,122 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+#include <unistd.h>
+
+// strim() gives the pages of free blocks back to the OS, except the first page of each
+// block which holds its header, and _num_purged_bytes() reports what is released
+
+#define MIN_BLOCK_SIZE 128
+#define MAX_ORDER 10
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define INITIAL_BLOCKS_NUM 32
+
+static size_t order_size(int order)
+{
+    return (size_t)MIN_BLOCK_SIZE << order;
+}
+
+static bool is_zero(const char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (memory[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("strim releases dirty free blocks", "[malloc3purge]")
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char *a = (char *)smalloc(MAX_ELEMENT_SIZE - _size_meta_data());
+    REQUIRE(a != nullptr);
+    memset(a, 'a', MAX_ELEMENT_SIZE - _size_meta_data());
+    REQUIRE(_num_purged_bytes() == 0);
+
+    // Untouched blocks of the arena are clean, only the freed one is released
+    sfree(a);
+    REQUIRE(_num_purged_bytes() == 0);
+    REQUIRE(strim() == MAX_ELEMENT_SIZE - page_size);
+    REQUIRE(_num_purged_bytes() == MAX_ELEMENT_SIZE - page_size);
+    REQUIRE(_num_free_blocks() == INITIAL_BLOCKS_NUM);
+
+    // Nothing is left to release
+    REQUIRE(strim() == 0);
+    REQUIRE(_num_purged_bytes() == MAX_ELEMENT_SIZE - page_size);
+
+    // The purged block is known to be zero, and stops counting once it is handed out
+    char *b = (char *)scalloc(1, MAX_ELEMENT_SIZE - _size_meta_data());
+    REQUIRE(b == a);
+    REQUIRE(is_zero(b, MAX_ELEMENT_SIZE - _size_meta_data()));
+    REQUIRE(_num_purged_bytes() == 0);
+    sfree(b);
+}
+
+TEST_CASE("purged pages survive merging with a buddy", "[malloc3purge]")
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t half_size = order_size(MAX_ORDER - 1) - _size_meta_data();
+    char *lower = (char *)smalloc(half_size);
+    char *upper = (char *)smalloc(half_size);
+    REQUIRE(lower != nullptr);
+    REQUIRE(upper == lower + order_size(MAX_ORDER - 1));
+    memset(lower, 'l', half_size);
+    memset(upper, 'u', half_size);
+
+    sfree(lower);
+    REQUIRE(strim() == order_size(MAX_ORDER - 1) - page_size);
+    REQUIRE(_num_purged_bytes() == order_size(MAX_ORDER - 1) - page_size);
+
+    // The merged top block still has the lower half released
+    sfree(upper);
+    REQUIRE(_num_free_blocks() == INITIAL_BLOCKS_NUM);
+    REQUIRE(_num_purged_bytes() == order_size(MAX_ORDER - 1) - page_size);
+
+    // Only the pages of the upper half are left to release, its header page included
+    REQUIRE(strim() == order_size(MAX_ORDER - 1));
+    REQUIRE(_num_purged_bytes() == MAX_ELEMENT_SIZE - page_size);
+
+    char *merged = (char *)scalloc(1, MAX_ELEMENT_SIZE - _size_meta_data());
+    REQUIRE(merged == lower);
+    REQUIRE(is_zero(merged, MAX_ELEMENT_SIZE - _size_meta_data()));
+    REQUIRE(_num_purged_bytes() == 0);
+    sfree(merged);
+}
+
+TEST_CASE("purged pages survive splitting", "[malloc3purge]")
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char *a = (char *)smalloc(MAX_ELEMENT_SIZE - _size_meta_data());
+    REQUIRE(a != nullptr);
+    memset(a, 'a', MAX_ELEMENT_SIZE - _size_meta_data());
+    sfree(a);
+    REQUIRE(strim() == MAX_ELEMENT_SIZE - page_size);
+
+    // Splitting the purged block down to the smallest order hands out its first block,
+    // each upper half keeps its released pages but the one its header is written to
+    char *small = (char *)smalloc(1);
+    REQUIRE(small == a);
+    size_t expected = 0;
+    size_t header_pages = 0;
+    for (int order = MAX_ORDER - 1; order >= 0; order--)
+    {
+        size_t half_pages = order_size(order) / page_size;
+        if (half_pages >= 1)
+        {
+            expected += (half_pages - 1) * page_size;
+            header_pages++;
+        }
+    }
+    REQUIRE(_num_purged_bytes() == expected);
+
+    // Merging back keeps the released pages, only the pages the headers faulted back in are left to release
+    sfree(small);
+    REQUIRE(_num_free_blocks() == INITIAL_BLOCKS_NUM);
+    REQUIRE(_num_purged_bytes() == expected);
+    REQUIRE(strim() == header_pages * page_size);
+    REQUIRE(_num_purged_bytes() == MAX_ELEMENT_SIZE - page_size);
+}
@@ -0,0 +1,158 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <cstring>
+
+// Built with MALLOC_SLAB, small requests are served from slabs carved out of buddy blocks
+
+#define SLAB_SLOTS_NUM 600
+#define LARGE_SIZE 3000
+#define SLAB_SIZE 4096
+
+// A slab is a single buddy block however many of its slots are handed out
+static size_t used_blocks()
+{
+    return _num_allocated_blocks() - _num_free_blocks();
+}
+
+static void fill(char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        memory[i] = (char)(i + 1);
+    }
+}
+
+static bool holds(const char *memory, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (memory[i] != (char)(i + 1))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_CASE("scalloc after empty slabs", "[malloc3slab]")
+{
+    void *slots[SLAB_SLOTS_NUM];
+    for (int i = 0; i < SLAB_SLOTS_NUM; i++)
+    {
+        slots[i] = smalloc(16);
+        REQUIRE(slots[i] != nullptr);
+    }
+    for (int i = 0; i < SLAB_SLOTS_NUM; i++)
+    {
+        sfree(slots[i]);
+    }
+
+    // The emptied slabs went back to the buddy heap, their memory must not pass as zeroed
+    for (int i = 0; i < 20; i++)
+    {
+        char *zeroed = (char *)scalloc(1, LARGE_SIZE);
+        REQUIRE(zeroed != nullptr);
+        for (int j = 0; j < LARGE_SIZE; j++)
+        {
+            REQUIRE(zeroed[j] == 0);
+        }
+    }
+}
+
+TEST_CASE("requests are routed by size class", "[malloc3slab]")
+{
+    // Sizes that round up to the same 16 byte class share a slab, slot after slot
+    char *a = (char *)smalloc(1);
+    char *b = (char *)smalloc(16);
+    REQUIRE(a != nullptr);
+    REQUIRE(b == a + 16);
+    REQUIRE(used_blocks() == 1);
+
+    // Every class has slabs of its own
+    char *c = (char *)smalloc(17);
+    char *d = (char *)smalloc(32);
+    REQUIRE(d == c + 32);
+    REQUIRE(used_blocks() == 2);
+    char *e = (char *)smalloc(128);
+    REQUIRE(e != nullptr);
+    REQUIRE(used_blocks() == 3);
+
+    // Past the largest class, requests get buddy blocks with a header
+    size_t free_bytes = _num_free_bytes();
+    char *f = (char *)smalloc(129);
+    REQUIRE(f != nullptr);
+    REQUIRE(used_blocks() == 4);
+    REQUIRE(_num_free_bytes() < free_bytes);
+
+    sfree(a);
+    sfree(b);
+    sfree(c);
+    sfree(d);
+    sfree(e);
+    sfree(f);
+}
+
+TEST_CASE("freed slots are reused first", "[malloc3slab]")
+{
+    char *a = (char *)smalloc(64);
+    char *b = (char *)smalloc(64);
+    char *c = (char *)smalloc(64);
+    REQUIRE(b == a + 64);
+    REQUIRE(c == b + 64);
+
+    sfree(b);
+    sfree(a);
+    REQUIRE(smalloc(64) == a);
+    REQUIRE(smalloc(64) == b);
+    REQUIRE(smalloc(64) == (char *)c + 64);
+    REQUIRE(used_blocks() == 1);
+}
+
+TEST_CASE("srealloc moves out of a slot", "[malloc3slab]")
+{
+    char *slot = (char *)smalloc(20);
+    REQUIRE(slot != nullptr);
+    fill(slot, 20);
+
+    // The 32 byte slot already has room
+    REQUIRE(srealloc(slot, 32) == slot);
+    REQUIRE(srealloc(slot, 10) == slot);
+
+    // Into a slot of a larger class, and out of the slabs altogether
+    char *larger_slot = (char *)srealloc(slot, 100);
+    REQUIRE(larger_slot != nullptr);
+    REQUIRE(larger_slot != slot);
+    REQUIRE(holds(larger_slot, 20));
+    fill(larger_slot, 100);
+    char *block = (char *)srealloc(larger_slot, 1000);
+    REQUIRE(block != nullptr);
+    REQUIRE(holds(block, 100));
+
+    // Both slots were given back
+    REQUIRE(smalloc(20) == slot);
+    REQUIRE(smalloc(100) == larger_slot);
+    sfree(slot);
+    sfree(larger_slot);
+    sfree(block);
+}
+
+TEST_CASE("empty slabs go back to the buddy heap", "[malloc3slab]")
+{
+    // Enough slots of one class to need several slabs
+    char *slots[SLAB_SLOTS_NUM];
+    for (int i = 0; i < SLAB_SLOTS_NUM; i++)
+    {
+        slots[i] = (char *)smalloc(48);
+        REQUIRE(slots[i] != nullptr);
+    }
+    size_t slabs_num = used_blocks();
+    REQUIRE(slabs_num >= SLAB_SLOTS_NUM * 48 / SLAB_SIZE);
+
+    // All but the last partial slab of the class are freed as they empty
+    for (int i = 0; i < SLAB_SLOTS_NUM; i++)
+    {
+        sfree(slots[i]);
+    }
+    REQUIRE(used_blocks() == 1);
+}
@@ -0,0 +1,269 @@
+#include "my_stdlib.h"
+#include <catch2/catch_test_macros.hpp>
+
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Built once per threaded front end: MALLOC_MULTITHREADED (thread caches),
+// MALLOC_PERCPU_CACHE (rseq bins) and MALLOC_THREAD_HEAPS (owned heaps with remote frees).
+// Catch2 assertions are not thread safe, so threads count failures and the test checks them after join.
+
+#define THREADS_NUM 8
+#define ROUNDS_NUM 20000
+#define MAX_SMALL_SIZE 3000
+#define MMAP_THRESHOLD (128 * 1024)
+#define INITIAL_BLOCKS_NUM 32
+
+struct Allocation
+{
+    unsigned char *memory;
+    size_t size;
+    unsigned char value;
+};
+
+static bool holds(const Allocation &allocation)
+{
+    for (size_t i = 0; i < allocation.size; i++)
+    {
+        if (allocation.memory[i] != allocation.value)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every block is free again, whether it sits in a free list, a cache or a remote free queue
+#define verify_all_free()                                       \
+    do                                                          \
+    {                                                           \
+        REQUIRE(_num_free_blocks() == _num_allocated_blocks()); \
+        REQUIRE(_num_free_bytes() == _num_allocated_bytes());   \
+    } while (0)
+
+TEST_CASE("threads keep their data", "[malloc3threads]")
+{
+    sfree(smalloc(1));
+    std::atomic<int> corruptions(0);
+    std::atomic<int> failed_allocations(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS_NUM; t++)
+    {
+        threads.emplace_back([t, &corruptions, &failed_allocations]
+                             {
+            std::mt19937 random(t);
+            std::vector<Allocation> live;
+            for (int i = 0; i < ROUNDS_NUM; i++)
+            {
+                if (live.size() < 64 && (live.empty() || random() % 2))
+                {
+                    // Mostly cached sizes, some buddy blocks above the caches and a few mappings
+                    size_t size = random() % 50 == 0 ? MMAP_THRESHOLD + random() % 4096 : 1 + random() % MAX_SMALL_SIZE;
+                    unsigned char *memory = (unsigned char *)smalloc(size);
+                    if (memory == nullptr)
+                    {
+                        failed_allocations++;
+                        continue;
+                    }
+                    unsigned char value = random();
+                    memset(memory, value, size);
+                    live.push_back({memory, size, value});
+                    continue;
+                }
+                size_t index = random() % live.size();
+                if (!holds(live[index]))
+                {
+                    corruptions++;
+                }
+                if (random() % 4 == 0)
+                {
+                    size_t new_size = 1 + random() % (2 * MAX_SMALL_SIZE);
+                    unsigned char *memory = (unsigned char *)srealloc(live[index].memory, new_size);
+                    if (memory != nullptr)
+                    {
+                        live[index].memory = memory;
+                        live[index].size = live[index].size < new_size ? live[index].size : new_size;
+                        if (!holds(live[index]))
+                        {
+                            corruptions++;
+                        }
+                        memset(memory, live[index].value, new_size);
+                        live[index].size = new_size;
+                    }
+                    continue;
+                }
+                sfree(live[index].memory);
+                live[index] = live.back();
+                live.pop_back();
+            }
+            for (const Allocation &allocation : live)
+            {
+                if (!holds(allocation))
+                {
+                    corruptions++;
+                }
+                sfree(allocation.memory);
+            } });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    REQUIRE(corruptions == 0);
+    REQUIRE(failed_allocations == 0);
+    verify_all_free();
+}
+
+TEST_CASE("cross-thread frees", "[malloc3threads]")
+{
+    sfree(smalloc(1));
+    std::mutex queue_mutex;
+    std::deque<Allocation> queue;
+    std::atomic<int> producers_left(THREADS_NUM / 2);
+    std::atomic<int> corruptions(0);
+    std::atomic<int> freed(0);
+    std::atomic<int> produced(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS_NUM / 2; t++)
+    {
+        // Producers allocate and fill blocks, and never free them
+        threads.emplace_back([t, &queue_mutex, &queue, &producers_left, &produced]
+                             {
+            std::mt19937 random(t);
+            for (int i = 0; i < ROUNDS_NUM; i++)
+            {
+                size_t size = 1 + random() % MAX_SMALL_SIZE;
+                unsigned char *memory = (unsigned char *)smalloc(size);
+                if (memory == nullptr)
+                {
+                    continue;
+                }
+                unsigned char value = random();
+                memset(memory, value, size);
+                std::lock_guard<std::mutex> guard(queue_mutex);
+                queue.push_back({memory, size, value});
+                produced++;
+            }
+            producers_left--; });
+    }
+    for (int t = 0; t < THREADS_NUM / 2; t++)
+    {
+        // Consumers check and free blocks allocated by other threads
+        threads.emplace_back([&queue_mutex, &queue, &producers_left, &corruptions, &freed]
+                             {
+            while (true)
+            {
+                Allocation allocation;
+                {
+                    std::lock_guard<std::mutex> guard(queue_mutex);
+                    if (queue.empty())
+                    {
+                        if (producers_left == 0)
+                        {
+                            return;
+                        }
+                        continue;
+                    }
+                    allocation = queue.front();
+                    queue.pop_front();
+                }
+                if (!holds(allocation))
+                {
+                    corruptions++;
+                }
+                sfree(allocation.memory);
+                freed++;
+            } });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    REQUIRE(produced > 0);
+    REQUIRE(freed == produced);
+    REQUIRE(corruptions == 0);
+    verify_all_free();
+
+    // Blocks freed by other threads find their way back to an owner
+    for (int t = 0; t < THREADS_NUM; t++)
+    {
+        std::thread([]
+                    {
+            for (int i = 0; i < ROUNDS_NUM; i++)
+            {
+                sfree(smalloc(1 + i % MAX_SMALL_SIZE));
+            } })
+            .join();
+    }
+    verify_all_free();
+}
+
+// Frees its blocks when the thread exits, after the allocator's own thread_local state is gone
+struct LateFrees
+{
+    std::vector<void *> blocks;
+
+    ~LateFrees()
+    {
+        for (void *block : blocks)
+        {
+            sfree(block);
+        }
+    }
+};
+
+TEST_CASE("thread exit hands blocks back", "[malloc3threads]")
+{
+    sfree(smalloc(1));
+    std::atomic<int> failed_allocations(0);
+    for (int round = 0; round < 4; round++)
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS_NUM; t++)
+        {
+            // Each thread exits with its cache full of freed blocks, and with a few of its blocks still alive
+            threads.emplace_back([&failed_allocations]
+                                 {
+                static thread_local LateFrees late_frees;
+                void *blocks[256];
+                for (int i = 0; i < 256; i++)
+                {
+                    blocks[i] = smalloc(1 + i * 8);
+                    if (blocks[i] == nullptr)
+                    {
+                        failed_allocations++;
+                    }
+                }
+                for (int i = 0; i < 256; i++)
+                {
+                    if (i % 16 == 0)
+                    {
+                        late_frees.blocks.push_back(blocks[i]);
+                    }
+                    else
+                    {
+                        sfree(blocks[i]);
+                    }
+                } });
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+    REQUIRE(failed_allocations == 0);
+    verify_all_free();
+
+#if defined(MALLOC_MULTITHREADED) && !defined(MALLOC_PERCPU_CACHE) && !defined(MALLOC_THREAD_HEAPS)
+    // Exited threads flushed their caches, once this thread flushes its own the whole arena
+    // merges back into top-order blocks
+    strim();
+    REQUIRE(_num_allocated_blocks() == INITIAL_BLOCKS_NUM);
+    REQUIRE(_num_free_blocks() == INITIAL_BLOCKS_NUM);
+#endif
+}
@@ -1,36 +1,34 @@
 #include "my_stdlib.h"
 #include <catch2/catch_test_macros.hpp>
 
+#include <cstring>
 #include <fstream>
 #include <unistd.h>
 
 #define MAX_ALLOCATION_SIZE (1e8)
 #define MMAP_THRESHOLD (128 * 1024)
-#define DEFAULT_MMAP_THRESHOLD_MAX (4 * 1024 * 1024 * sizeof(long))
+#define MAX_ELEMENT_SIZE (128 * 1024)
+#define ARENA_BLOCKS (32)
 #define SMALLOC_HUGE_PAGE_THRESHOLD (1000 * 1000 * 4)
 #define SCALLOC_HUGE_PAGE_THRESHOLD (1000 * 1000 * 2)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
 static inline size_t aligned_size(size_t size)
 {
     return (size % 8) ? (size & (size_t)(-8)) + 8 : size;
 }
 
-#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
-    do                                                                                                                 \
-    {                                                                                                                  \
-        REQUIRE(_num_allocated_blocks() == allocated_blocks);                                                          \
-        REQUIRE(_num_allocated_bytes() == aligned_size(allocated_bytes));                                              \
-        REQUIRE(_num_free_blocks() == free_blocks);                                                                    \
-        REQUIRE(_num_free_bytes() == aligned_size(free_bytes));                                                        \
-        REQUIRE(_num_meta_data_bytes() == aligned_size(_size_meta_data() * allocated_blocks));                         \
-    } while (0)
+// The 32 free top-order blocks of the arena are counted in every statistic
+#define ARENA_BYTES (ARENA_BLOCKS * (MAX_ELEMENT_SIZE - _size_meta_data()))
 
-#define verify_size(base)                                                                                              \
+#define verify_blocks(allocated_blocks, allocated_bytes, free_blocks, free_bytes)                                      \
     do                                                                                                                 \
     {                                                                                                                  \
-        void *after = sbrk(0);                                                                                         \
-        REQUIRE(_num_allocated_bytes() + aligned_size(_size_meta_data() * _num_allocated_blocks()) ==                  \
-                (size_t)after - (size_t)base);                                                                         \
+        REQUIRE(_num_allocated_blocks() == ARENA_BLOCKS + (allocated_blocks));                                         \
+        REQUIRE(_num_allocated_bytes() == ARENA_BYTES + aligned_size(allocated_bytes));                                \
+        REQUIRE(_num_free_blocks() == ARENA_BLOCKS + (free_blocks));                                                   \
+        REQUIRE(_num_free_bytes() == ARENA_BYTES + aligned_size(free_bytes));                                          \
+        REQUIRE(_num_meta_data_bytes() == _size_meta_data() * (ARENA_BLOCKS + (allocated_blocks)));                    \
     } while (0)
 
 #define verify_size_with_large_blocks(base, diff)                                                                      \
@@ -40,29 +38,60 @@ static inline size_t aligned_size(size_t size)
         REQUIRE(diff == (size_t)after - (size_t)base);                                                                 \
     } while (0)
 
-long long get_huge_pages_amount()
+// Sets up the arena, so the program break stays put for the rest of the test
+static void *init_arena()
+{
+    sfree(smalloc(1));
+    verify_blocks(0, 0, 0, 0);
+    return sbrk(0);
+}
+
+static long long get_meminfo_value(const std::string &key)
 {
     std::ifstream meminfo("/proc/meminfo");
     REQUIRE(meminfo.is_open());
     std::string line;
-    long long total = -1;
-    long long free = -1;
     while (getline(meminfo, line))
     {
-        if (line.find("HugePages_Total") != std::string::npos)
-        {
-            std::string sub = line.substr(line.find(":") + 1);
-            total = std::atoll(sub.c_str());
-        }
-        if (line.find("HugePages_Free") != std::string::npos)
+        if (line.compare(0, key.size() + 1, key + ":") == 0)
         {
-            std::string sub = line.substr(line.find(":") + 1);
-            free = std::atoll(sub.c_str());
+            return std::atoll(line.substr(key.size() + 1).c_str());
         }
     }
-    REQUIRE(total != -1);
-    REQUIRE(free != -1);
-    return total - free;
+    FAIL("missing " << key << " in /proc/meminfo");
+    return -1;
+}
+
+// The original helper returned HugePages_Total - HugePages_Free, which only counts
+// huge pages that were faulted in. A private MAP_HUGETLB mapping reserves all its
+// pages up front (HugePages_Rsvd) and faults them in one by one, so that count
+// depended on how much of a block had been touched: 1 for a fresh 4 MB block whose
+// header shares its first page, 2 once the block was written. Counting the reserved
+// pages too gives the whole footprint of the live huge mappings, independent of
+// which pages were touched, so the tests below may write their blocks.
+long long get_huge_pages_amount()
+{
+    return get_meminfo_value("HugePages_Total") - get_meminfo_value("HugePages_Free") +
+           get_meminfo_value("HugePages_Rsvd");
+}
+
+long long get_huge_pages_available()
+{
+    return get_meminfo_value("HugePages_Free") - get_meminfo_value("HugePages_Rsvd");
+}
+
+// Huge pages a huge block of this size takes. The original cases assumed a pool with
+// free pages, a block that finds the pool too small falls back to normal pages and
+// takes none, so expectations are computed from the pool left when the test started.
+long long take_huge_pages(long long *available, size_t size)
+{
+    long long pages = (sysconf(_SC_PAGESIZE) + size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE;
+    if (pages > *available)
+    {
+        return 0;
+    }
+    *available -= pages;
+    return pages;
 }
 
 #define validate_huge_pages_amount(base, amount)                                                                       \
@@ -73,170 +102,172 @@ long long get_huge_pages_amount()
 
 TEST_CASE("Huge pages smalloc", "[malloc4]")
 {
-    void *base = sbrk(0);
+    void *base = init_arena();
     long long huge_pages_base = get_huge_pages_amount();
+    long long huge_pages_available = get_huge_pages_available();
 
     char *a = (char *)smalloc(SMALLOC_HUGE_PAGE_THRESHOLD);
     REQUIRE(a != nullptr);
     verify_blocks(1, SMALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    long long a_pages = take_huge_pages(&huge_pages_available, SMALLOC_HUGE_PAGE_THRESHOLD);
+    validate_huge_pages_amount(huge_pages_base, a_pages);
 
+    // Just under the threshold, the block is mapped with normal pages
     char *b = (char *)smalloc(SMALLOC_HUGE_PAGE_THRESHOLD - 8);
     REQUIRE(b != nullptr);
     verify_blocks(2, 2 * SMALLOC_HUGE_PAGE_THRESHOLD - 8, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    validate_huge_pages_amount(huge_pages_base, a_pages);
+
+    // Huge or not, both blocks must be usable end to end
+    memset(a, 'a', SMALLOC_HUGE_PAGE_THRESHOLD);
+    memset(b, 'b', SMALLOC_HUGE_PAGE_THRESHOLD - 8);
+    REQUIRE(a[SMALLOC_HUGE_PAGE_THRESHOLD - 1] == 'a');
+    REQUIRE(b[SMALLOC_HUGE_PAGE_THRESHOLD - 9] == 'b');
 
     sfree(a);
     verify_blocks(1, SMALLOC_HUGE_PAGE_THRESHOLD - 8, 0, 0);
     verify_size_with_large_blocks(base, 0);
+    validate_huge_pages_amount(huge_pages_base, 0);
 
     sfree(b);
     verify_blocks(0, 0, 0, 0);
-    verify_size(base);
+    verify_size_with_large_blocks(base, 0);
 }
 
 TEST_CASE("Huge pages smalloc realloc", "[malloc4]")
 {
-    void *base = sbrk(0);
+    void *base = init_arena();
     long long huge_pages_base = get_huge_pages_amount();
+    long long huge_pages_available = get_huge_pages_available();
 
     char *a = (char *)smalloc(MMAP_THRESHOLD);
     REQUIRE(a != nullptr);
     verify_blocks(1, MMAP_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
     validate_huge_pages_amount(huge_pages_base, 0);
+    memset(a, 'a', MMAP_THRESHOLD);
 
+    // The scalloc threshold does not apply to smalloc blocks
     char *big_a = (char *)srealloc(a, SCALLOC_HUGE_PAGE_THRESHOLD);
     REQUIRE(big_a != nullptr);
     verify_blocks(1, SCALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
+    validate_huge_pages_amount(huge_pages_base, 0);
 
     char *huge_a = (char *)srealloc(big_a, SMALLOC_HUGE_PAGE_THRESHOLD);
     REQUIRE(huge_a != nullptr);
     verify_blocks(1, SMALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    validate_huge_pages_amount(huge_pages_base, take_huge_pages(&huge_pages_available, SMALLOC_HUGE_PAGE_THRESHOLD));
+    REQUIRE(huge_a[0] == 'a');
+    REQUIRE(huge_a[MMAP_THRESHOLD - 1] == 'a');
 
     sfree(huge_a);
     verify_blocks(0, 0, 0, 0);
-    verify_size(base);
+    verify_size_with_large_blocks(base, 0);
+    validate_huge_pages_amount(huge_pages_base, 0);
 }
 
 TEST_CASE("Huge pages scalloc", "[malloc4]")
 {
-    void *base = sbrk(0);
+    void *base = init_arena();
     long long huge_pages_base = get_huge_pages_amount();
+    long long huge_pages_available = get_huge_pages_available();
 
     char *a = (char *)scalloc(1, SCALLOC_HUGE_PAGE_THRESHOLD);
     REQUIRE(a != nullptr);
     verify_blocks(1, SCALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    long long a_pages = take_huge_pages(&huge_pages_available, SCALLOC_HUGE_PAGE_THRESHOLD);
+    validate_huge_pages_amount(huge_pages_base, a_pages);
 
     char *b = (char *)scalloc(1, SCALLOC_HUGE_PAGE_THRESHOLD - 8);
     REQUIRE(b != nullptr);
     verify_blocks(2, 2 * SCALLOC_HUGE_PAGE_THRESHOLD - 8, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    validate_huge_pages_amount(huge_pages_base, a_pages);
+
+    for (int i = 0; i < SCALLOC_HUGE_PAGE_THRESHOLD; i += 4096)
+    {
+        REQUIRE(a[i] == 0);
+    }
+    REQUIRE(a[SCALLOC_HUGE_PAGE_THRESHOLD - 1] == 0);
+    REQUIRE(b[SCALLOC_HUGE_PAGE_THRESHOLD - 9] == 0);
 
     sfree(a);
     verify_blocks(1, SCALLOC_HUGE_PAGE_THRESHOLD - 8, 0, 0);
     verify_size_with_large_blocks(base, 0);
+    validate_huge_pages_amount(huge_pages_base, 0);
 
     sfree(b);
     verify_blocks(0, 0, 0, 0);
-    verify_size(base);
+    verify_size_with_large_blocks(base, 0);
 }
 
 TEST_CASE("Huge pages scalloc realloc", "[malloc4]")
 {
-    void *base = sbrk(0);
+    void *base = init_arena();
     long long huge_pages_base = get_huge_pages_amount();
+    long long huge_pages_available = get_huge_pages_available();
 
     char *a = (char *)scalloc(MMAP_THRESHOLD, 1);
     REQUIRE(a != nullptr);
     verify_blocks(1, MMAP_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
     validate_huge_pages_amount(huge_pages_base, 0);
+    memset(a, 'a', MMAP_THRESHOLD);
 
+    // A scalloc block keeps the scalloc threshold when it grows
     char *huge_a = (char *)srealloc(a, SCALLOC_HUGE_PAGE_THRESHOLD);
     REQUIRE(huge_a != nullptr);
     verify_blocks(1, SCALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
-    validate_huge_pages_amount(huge_pages_base, 1);
+    validate_huge_pages_amount(huge_pages_base, take_huge_pages(&huge_pages_available, SCALLOC_HUGE_PAGE_THRESHOLD));
+    REQUIRE(huge_a[MMAP_THRESHOLD - 1] == 'a');
 
     sfree(huge_a);
     verify_blocks(0, 0, 0, 0);
-    verify_size(base);
-}
-
-TEST_CASE("Dynamic mmap", "[malloc4]")
-{
-    verify_blocks(0, 0, 0, 0);
-    void *base = sbrk(0);
-    char *a = (char *)smalloc(MMAP_THRESHOLD + 8);
-    REQUIRE(a != nullptr);
-    verify_blocks(1, MMAP_THRESHOLD + 8, 0, 0);
     verify_size_with_large_blocks(base, 0);
-
-    sfree(a);
-    verify_blocks(0, 0, 0, 0);
-    verify_size(base);
-
-    char *b = (char *)smalloc(MMAP_THRESHOLD);
-    REQUIRE(b != nullptr);
-    verify_blocks(1, MMAP_THRESHOLD, 0, 0);
-    verify_size(base);
-
-    sfree(b);
-    verify_blocks(1, MMAP_THRESHOLD, 1, MMAP_THRESHOLD);
-    verify_size(base);
+    validate_huge_pages_amount(huge_pages_base, 0);
 }
 
-TEST_CASE("Dynamic mmap 2", "[malloc4]")
+TEST_CASE("Huge pages fall back to normal pages", "[malloc4]")
 {
-    verify_blocks(0, 0, 0, 0);
-    void *base = sbrk(0);
-    char *a = (char *)smalloc(MMAP_THRESHOLD + 8 * 4);
-    REQUIRE(a != nullptr);
-    verify_blocks(1, MMAP_THRESHOLD + 8 * 4, 0, 0);
-    verify_size_with_large_blocks(base, 0);
-
-    sfree(a);
-    verify_blocks(0, 0, 0, 0);
-    verify_size(base);
-
-    char *b = (char *)smalloc(MMAP_THRESHOLD + 8 * 2);
-    REQUIRE(b != nullptr);
-    verify_blocks(1, MMAP_THRESHOLD + 8 * 2, 0, 0);
-    verify_size(base);
-
-    sfree(b);
-    verify_blocks(1, MMAP_THRESHOLD + 8 * 2, 1, MMAP_THRESHOLD + 8 * 2);
-    verify_size(base);
-}
+    void *base = init_arena();
+    long long huge_pages_base = get_huge_pages_amount();
+    long long huge_pages_available = get_huge_pages_available();
 
-TEST_CASE("Dynamic mmap threshold max", "[malloc4]")
-{
-    verify_blocks(0, 0, 0, 0);
-    void *base = sbrk(0);
-    char *a = (char *)smalloc(DEFAULT_MMAP_THRESHOLD_MAX);
-    REQUIRE(a != nullptr);
-    verify_blocks(1, DEFAULT_MMAP_THRESHOLD_MAX, 0, 0);
+    // Keep asking for huge blocks until the pool runs dry, then some more
+    const int blocks_num = 4;
+    char *blocks[blocks_num];
+    long long expected_pages = 0;
+    for (int i = 0; i < blocks_num; i++)
+    {
+        blocks[i] = (char *)smalloc(SMALLOC_HUGE_PAGE_THRESHOLD);
+        REQUIRE(blocks[i] != nullptr);
+        expected_pages += take_huge_pages(&huge_pages_available, SMALLOC_HUGE_PAGE_THRESHOLD);
+        validate_huge_pages_amount(huge_pages_base, expected_pages);
+        memset(blocks[i], 'a' + i, SMALLOC_HUGE_PAGE_THRESHOLD);
+    }
+    verify_blocks(blocks_num, blocks_num * SMALLOC_HUGE_PAGE_THRESHOLD, 0, 0);
     verify_size_with_large_blocks(base, 0);
 
-    sfree(a);
+    for (int i = 0; i < blocks_num; i++)
+    {
+        REQUIRE(blocks[i][0] == 'a' + i);
+        REQUIRE(blocks[i][SMALLOC_HUGE_PAGE_THRESHOLD - 1] == 'a' + i);
+        sfree(blocks[i]);
+    }
     verify_blocks(0, 0, 0, 0);
-    verify_size(base);
-
-    char *b = (char *)smalloc(DEFAULT_MMAP_THRESHOLD_MAX - 8);
-    REQUIRE(b != nullptr);
-    verify_blocks(1, DEFAULT_MMAP_THRESHOLD_MAX - 8, 0, 0);
-    verify_size(base);
-
-    sfree(b);
-    verify_blocks(1, DEFAULT_MMAP_THRESHOLD_MAX - 8, 1, DEFAULT_MMAP_THRESHOLD_MAX - 8);
-    verify_size(base);
+    verify_size_with_large_blocks(base, 0);
+    validate_huge_pages_amount(huge_pages_base, 0);
 }
+
+// The original "Dynamic mmap", "Dynamic mmap 2" and "Dynamic mmap threshold max" cases
+// are left out. They expect the glibc sliding threshold: once a mapped block of up to
+// DEFAULT_MMAP_THRESHOLD_MAX is freed, requests up to its size are served from an sbrk
+// heap that grows by each request. Here the heap is the fixed buddy arena, whose
+// largest block is MAX_ELEMENT_SIZE including its metadata, so everything above that
+// has to be mapped and the threshold cannot move.
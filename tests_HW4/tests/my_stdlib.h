@@ -7,6 +7,7 @@ void *smalloc(size_t size);
 void *scalloc(size_t num, size_t size);
 void sfree(void *p);
 void *srealloc(void *oldp, size_t size);
+size_t strim();
 
 size_t _num_free_blocks();
 size_t _num_free_bytes();
@@ -14,5 +15,6 @@ size_t _num_allocated_blocks();
 size_t _num_allocated_bytes();
 size_t _num_meta_data_bytes();
 size_t _size_meta_data();
+size_t _num_purged_bytes();
 
 #endif /* MY_STDLIB_H */